@@ -2,18 +2,39 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <codecvt>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
 #include <locale>
-
-bool global_error = false;
+#include <random>
+#include <string>
+#include <vector>
+
+#include "codecvt_facets.h"
+#include "codecvt_length.h"
+#include "dfa_codecvt.h"
+#include "direct_codecvt.h"
+#include "locale_registry.h"
+#include "parallel_codecvt.h"
+#include "simd_codecvt.h"
+#include "utf_kernels.h"
+
+// Number of failed VERIFYs on the calling thread. The test runner counts
+// the failures of a task by the difference before and after it, so VERIFY
+// must be used on the thread that runs the task.
+thread_local unsigned thread_errors = 0;
 
 #define VERIFY(X)                                                              \
   do                                                                           \
     {                                                                          \
       if (!(X))                                                                \
 	{                                                                      \
-	  global_error = true;                                                 \
+	  ++thread_errors;                                                     \
 	  printf (                                                             \
 	    "Error in line: %d,\n    Function: %s,\n    Assertion: %s\n",      \
 	    __LINE__, __FUNCTION__, #X);                                       \
@@ -2302,118 +2323,1289 @@ test_utf16_ucs2_cvt (const std::codecvt<InternT, char, mbstate_t> &cvt,
   ucs2_to_utf16_out_error (cvt, endianess);
 }
 
+template <class InternT, class ExternT>
+void
+test_length_bulk (const std::codecvt<InternT, ExternT, mbstate_t> &cvt)
+{
+  using namespace std;
+  // Three times the UTF-8 string of 1-byte CP, 2-byte CP, 3-byte CP and
+  // 4-byte CP, so the chunks split every kind of CP at every position.
+  const unsigned char input[] = "b\u0448\uAAAA\U0010AAAA"
+				"b\u0448\uAAAA\U0010AAAA"
+				"b\u0448\uAAAA\U0010AAAA";
+  static_assert (array_size (input) == 31, "");
+
+  ExternT in[array_size (input)];
+  copy (begin (input), end (input), begin (in));
+
+  // replace_pos == 30 replaces the terminating null, i.e. no error
+  size_t replace_pos[] = {30, 13, 16, 20};
+  for (auto pos : replace_pos)
+    {
+      auto old_char = in[pos];
+      in[pos] = (unsigned char) 0xFF;
+      for (size_t in_size = 0; in_size <= 30; ++in_size)
+	for (size_t max = 0; max <= 13; ++max)
+	  for (size_t chunk = 1; chunk <= 31; ++chunk)
+	    {
+	      auto state = mbstate_t{};
+	      auto len = cvt.length (state, in, in + in_size, max);
+	      VERIFY (len >= 0);
+
+	      state = {};
+	      auto len_bulk
+		= codecvt_length_bulk (cvt, state, in, in + in_size, max, chunk);
+	      VERIFY (len_bulk == static_cast<size_t> (len));
+	    }
+      in[pos] = old_char;
+    }
+}
+
+// length () of UTF-8 to UTF-16 on inputs longer than the scratch buffers of
+// the facets: an ASCII prefix of n bytes, U+10AAAA and "bb", with n around
+// 256 and 512 so that the surrogate pair falls on every unit near the
+// boundaries of the buffers.
+void
+test_utf8_utf16_length_long (
+  const std::codecvt<char16_t, char, mbstate_t> &cvt)
+{
+  using namespace std;
+  for (size_t base : {256, 512})
+    for (auto n = base - 4; n <= base + 4; ++n)
+      {
+	auto in = string (n, 'a') + "\U0010AAAA" + "bb";
+	// max, expected length
+	const size_t cases[][2] = {{10000, n + 6}, {n + 4, n + 6},
+				   {n + 3, n + 5}, {n + 2, n + 4},
+				   {n + 1, n},	   {n, n}};
+	for (auto &c : cases)
+	  {
+	    auto state = mbstate_t{};
+	    auto len = cvt.length (state, in.data (), in.data () + in.size (),
+				   c[0]);
+	    VERIFY (size_t (len) == c[1]);
+	  }
+      }
+}
+
+// Compares parallel_utf8_in with one call to in (), with an error or an
+// incomplete character at every position and with every output size, using
+// slices that are small enough to cut every kind of CP.
+template <class InternT>
+void
+test_parallel_utf8_in (const std::codecvt<InternT, char, mbstate_t> &cvt,
+		       thread_pool &pool)
+{
+  using namespace std;
+  const char cps[] = "b\u0448\uAAAA\U0010AAAA";
+  auto input = string ();
+  for (int i = 0; i < 8; ++i)
+    input += cps;
+  const char replace_chars[] = {'\0', '\xFF', '\x80', 'b'};
+  auto out1 = vector<InternT> (input.size ());
+  auto out2 = vector<InternT> (input.size ());
+  for (size_t pos = 0; pos != input.size (); ++pos)
+    for (auto c : replace_chars)
+      {
+	auto in = input;
+	if (c)
+	  in[pos] = c;
+	else
+	  in.resize (pos);
+	const char *first = in.data ();
+	const char *last = first + in.size ();
+	for (size_t out_size = 0; out_size <= in.size (); out_size += 7)
+	  {
+	    auto state = mbstate_t ();
+	    auto in_next1 = first;
+	    auto out_next1 = out1.data ();
+	    auto res1 = cvt.in (state, first, last, in_next1, out1.data (),
+				out1.data () + out_size, out_next1);
+	    auto in_next2 = first;
+	    auto out_next2 = out2.data ();
+	    auto res2 = parallel_utf8_in (cvt, pool, first, last, in_next2,
+					  out2.data (), out2.data () + out_size,
+					  out_next2, 5);
+	    VERIFY (res1 == res2);
+	    VERIFY (in_next1 == in_next2);
+	    VERIFY (out_next1 - out1.data () == out_next2 - out2.data ());
+	    VERIFY (equal (out1.data (), out_next1, out2.data ()));
+	  }
+      }
+}
+
+// Like test_parallel_utf8_in for parallel_utf16_in, with a lone high or low
+// surrogate, a BMP unit or a truncation at every position.
+template <class InternT>
+void
+test_parallel_utf16_in (const std::codecvt<InternT, char, mbstate_t> &cvt,
+			thread_pool &pool, utf16_endianess endianess)
+{
+  using namespace std;
+  const char16_t cps[] = u"b\u0448\uAAAA\U0010AAAA";
+  auto units = u16string ();
+  for (int i = 0; i < 8; ++i)
+    units += cps;
+  const char16_t replace_units[] = {0, 0xD800, 0xDC00, u'b'};
+  auto out1 = vector<InternT> (units.size ());
+  auto out2 = vector<InternT> (units.size ());
+  for (size_t pos = 0; pos != 2 * units.size (); ++pos)
+    for (auto u : replace_units)
+      {
+	auto replaced = units;
+	if (u && pos % 2 == 0)
+	  replaced[pos / 2] = u;
+	else if (u)
+	  continue;
+	auto in = string (2 * replaced.size (), '\0');
+	utf16_to_bytes (replaced.begin (), replaced.end (), in.begin (),
+			endianess);
+	if (!u)
+	  in.resize (pos);
+	const char *first = in.data ();
+	const char *last = first + in.size ();
+	for (size_t out_size = 0; out_size <= units.size (); out_size += 3)
+	  {
+	    auto state = mbstate_t ();
+	    auto in_next1 = first;
+	    auto out_next1 = out1.data ();
+	    auto res1 = cvt.in (state, first, last, in_next1, out1.data (),
+				out1.data () + out_size, out_next1);
+	    auto in_next2 = first;
+	    auto out_next2 = out2.data ();
+	    auto res2 = parallel_utf16_in (
+	      cvt, pool, endianess == utf16_little_endian, first, last,
+	      in_next2, out2.data (), out2.data () + out_size, out_next2, 5);
+	    VERIFY (res1 == res2);
+	    VERIFY (in_next1 == in_next2);
+	    VERIFY (out_next1 - out1.data () == out_next2 - out2.data ());
+	    VERIFY (equal (out1.data (), out_next1, out2.data ()));
+	  }
+      }
+}
+
 using namespace std;
 
+// Calls f once for every level of the conversion kernels that the CPU
+// supports, so that the accelerated facets are tested with all of them. The
+// level is switched only for the calling thread, so that tasks can do this
+// concurrently.
+template <class Func>
 void
-test_utf8_utf32_codecvts ()
+for_each_kernel_level (Func f)
 {
-  using codecvt_c32 = codecvt<char32_t, char, mbstate_t>;
-  auto loc_c = locale::classic ();
-  VERIFY (has_facet<codecvt_c32> (loc_c));
+  for (int l = utf_kernel_scalar; l <= utf_kernel_avx512; ++l)
+    if (set_thread_utf_kernel_level (utf_kernel_level (l)))
+      f ();
+  reset_thread_utf_kernel_level ();
+}
+
+// Appends the UTF-16 code units of c. Surrogates are appended as they are.
+template <class CharT>
+void
+append_utf16 (basic_string<CharT> &s, char32_t c)
+{
+  if (c < 0x10000)
+    s += CharT (c);
+  else
+    {
+      s += CharT (0xD7C0 + (c >> 10));
+      s += CharT (0xDC00 + (c & 0x3FF));
+    }
+}
+
+// Appends c in the internal encoding of the family.
+template <class InternT>
+void
+append_intern (basic_string<InternT> &s, char32_t c, codecvt_family family)
+{
+  if (family_intern_is_utf16 (family))
+    append_utf16 (s, c);
+  else
+    s += InternT (c);
+}
+
+// Appends c in the external encoding of the family, UTF-8 or UTF-16 bytes.
+// Surrogates are encoded as if they were scalar values.
+template <class ExternT>
+void
+append_extern (basic_string<ExternT> &s, char32_t c, codecvt_family family,
+	       utf16_endianess endianess)
+{
+  if (family == family_utf16_utf32 || family == family_utf16_ucs2)
+    {
+      auto units = u16string ();
+      append_utf16 (units, c);
+      utf16_to_bytes (units.begin (), units.end (), back_inserter (s),
+		      endianess);
+    }
+  else if (c < 0x80)
+    s += ExternT (c);
+  else if (c < 0x800)
+    {
+      s += ExternT (0xC0 | c >> 6);
+      s += ExternT (0x80 | (c & 0x3F));
+    }
+  else if (c < 0x10000)
+    {
+      s += ExternT (0xE0 | c >> 12);
+      s += ExternT (0x80 | (c >> 6 & 0x3F));
+      s += ExternT (0x80 | (c & 0x3F));
+    }
+  else
+    {
+      s += ExternT (0xF0 | c >> 18);
+      s += ExternT (0x80 | (c >> 12 & 0x3F));
+      s += ExternT (0x80 | (c >> 6 & 0x3F));
+      s += ExternT (0x80 | (c & 0x3F));
+    }
+}
+
+// Checks that out() converts intern to ext, and in() and length() ext to
+// intern, each in one call with output buffers of the exact size.
+template <class InternT, class ExternT>
+bool
+round_trips (const codecvt<InternT, ExternT, mbstate_t> &cvt,
+	     const basic_string<InternT> &intern,
+	     const basic_string<ExternT> &ext)
+{
+  auto ext_buf = basic_string<ExternT> (ext.size (), 0);
+  auto state = mbstate_t{};
+  auto intern_end = intern.data () + intern.size ();
+  auto intern_next = intern.data ();
+  auto ext_next = ext_buf.data ();
+  auto res = cvt.out (state, intern.data (), intern_end, intern_next,
+		      ext_buf.data (), ext_buf.data () + ext_buf.size (),
+		      ext_next);
+  if (res != cvt.ok || intern_next != intern_end
+      || ext_next != ext_buf.data () + ext_buf.size () || ext_buf != ext)
+    return false;
+
+  auto intern_buf = basic_string<InternT> (intern.size (), 0);
+  state = {};
+  auto ext_end = ext.data () + ext.size ();
+  auto ext_in_next = ext.data ();
+  auto intern_out_next = intern_buf.data ();
+  res = cvt.in (state, ext.data (), ext_end, ext_in_next, intern_buf.data (),
+		intern_buf.data () + intern_buf.size (), intern_out_next);
+  if (res != cvt.ok || ext_in_next != ext_end
+      || intern_out_next != intern_buf.data () + intern_buf.size ()
+      || intern_buf != intern)
+    return false;
+
+  state = {};
+  auto len = cvt.length (state, ext.data (), ext_end, intern.size ());
+  return len >= 0 && size_t (len) == ext.size ();
+}
+
+// Checks that out() stops with error before the first character of intern.
+template <class InternT, class ExternT>
+bool
+out_is_error (const codecvt<InternT, ExternT, mbstate_t> &cvt,
+	      const basic_string<InternT> &intern)
+{
+  ExternT out[16] = {};
+  auto state = mbstate_t{};
+  auto in_next = intern.data ();
+  auto out_next = out;
+  auto res = cvt.out (state, intern.data (), intern.data () + intern.size (),
+		      in_next, out, out + array_size (out), out_next);
+  return res == cvt.error && in_next == intern.data () && out_next == out;
+}
+
+// Checks that in() stops with error and length() stops before the first
+// character of ext.
+template <class InternT, class ExternT>
+bool
+in_is_error (const codecvt<InternT, ExternT, mbstate_t> &cvt,
+	     const basic_string<ExternT> &ext)
+{
+  InternT out[16] = {};
+  auto state = mbstate_t{};
+  auto in_next = ext.data ();
+  auto out_next = out;
+  auto res = cvt.in (state, ext.data (), ext.data () + ext.size (), in_next,
+		     out, out + array_size (out), out_next);
+  if (res != cvt.error || in_next != ext.data () || out_next != out)
+    return false;
+  state = {};
+  return cvt.length (state, ext.data (), ext.data () + ext.size (), 16) == 0;
+}
+
+// Tests the code points in [first, last) with cvt, one shard of
+// test_all_code_points. The code points that the facet can represent must
+// round-trip. They are converted together and, if that fails, one by one to
+// find the failing ones. Surrogates must be errors in out() and in(), the
+// high ones followed by 'b' so that they are not incomplete. In the UCS-2
+// families the code points above the BMP must be errors in in(). Prints the
+// first few failures, counted in printed. Returns the number of failed
+// checks.
+template <class InternT, class ExternT>
+unsigned
+test_code_point_range (const codecvt<InternT, ExternT, mbstate_t> &cvt,
+		       const char *name, codecvt_family family,
+		       utf16_endianess endianess, char32_t first,
+		       char32_t last, atomic<unsigned> &printed)
+{
+  auto failures = 0u;
+  auto fail = [&] (char32_t c, const char *what) {
+    ++failures;
+    if (printed++ < 16)
+      printf ("%s: %s fails for U+%04X\n", name, what, unsigned (c));
+  };
+  auto is_valid = [&] (char32_t c) {
+    return (c < 0xD800 || c > 0xDFFF)
+	   && (c < 0x10000 || !family_is_bmp_only (family));
+  };
+
+  auto intern = basic_string<InternT> ();
+  auto ext = basic_string<ExternT> ();
+  for (auto c = first; c != last; ++c)
+    if (is_valid (c))
+      {
+	append_intern (intern, c, family);
+	append_extern (ext, c, family, endianess);
+      }
+  if (!intern.empty () && !round_trips (cvt, intern, ext))
+    for (auto c = first; c != last; ++c)
+      if (is_valid (c))
+	{
+	  intern.clear ();
+	  ext.clear ();
+	  append_intern (intern, c, family);
+	  append_extern (ext, c, family, endianess);
+	  if (!round_trips (cvt, intern, ext))
+	    fail (c, "round trip");
+	}
+
+  for (auto c = first; c != last; ++c)
+    {
+      if (is_valid (c))
+	continue;
+      intern.clear ();
+      ext.clear ();
+      if (c < 0x10000)
+	{
+	  intern += InternT (c);
+	  if (c < 0xDC00)
+	    intern += InternT ('b');
+	  if (!out_is_error (cvt, intern))
+	    fail (c, "out() error");
+	}
+      append_extern (ext, c, family, endianess);
+      if (c < 0xDC00)
+	append_extern (ext, U'b', family, endianess);
+      if (!in_is_error (cvt, ext))
+	fail (c, "in() error");
+    }
+  return failures;
+}
+
+// With --exhaustive: tests every code point from U+0000 to U+10FFFF and
+// every surrogate with every facet from for_each_codecvt, see
+// test_code_point_range. Every facet is sharded across a pool with all
+// hardware threads. The shards share the const facet object.
+void
+test_all_code_points ()
+{
+  const char32_t shard_size = 0x1000;
+  thread_pool pool;
+  for_each_codecvt ([&] (const char *name, codecvt_family family,
+			 const auto &cvt) {
+    auto t0 = chrono::steady_clock::now ();
+    // The names of the UTF-16 facets end with BE or LE.
+    auto endianess
+      = strstr (name, " LE") ? utf16_little_endian : utf16_big_endian;
+    auto failures = atomic<unsigned> (0);
+    auto printed = atomic<unsigned> (0);
+    pool.parallel_for (0x110000 / shard_size, [&] (size_t i) {
+      auto first = char32_t (i * shard_size);
+      failures += test_code_point_range (cvt, name, family, endianess, first,
+					 first + shard_size, printed);
+    });
+    auto seconds
+      = chrono::duration<double> (chrono::steady_clock::now () - t0).count ();
+    printf ("# all code points, %-36s %8u failures %10.1f ms\n", name,
+	    failures.load (), seconds * 1e3);
+    VERIFY (failures == 0);
+  });
+}
+
+// The first character of a UTF-8 sequence as decoded by utf8_oracle.
+struct utf8_oracle_result
+{
+  codecvt_base::result res;
+  size_t len;
+  char32_t cp;
+};
+
+// Reference decoder, written straight from the table of well-formed byte
+// sequences of the Unicode standard. Decodes the first character of
+// [s, s + n), n > 0. The result is ok with the length and the code point,
+// partial if all n bytes are a valid beginning of a longer character, or
+// error.
+utf8_oracle_result
+utf8_oracle (const unsigned char *s, size_t n)
+{
+  auto c = s[0];
+  auto len = size_t ();
+  auto cp = char32_t ();
+  unsigned char lo = 0x80, hi = 0xBF;
+  if (c < 0x80)
+    return {codecvt_base::ok, 1, c};
+  else if (c < 0xC2)
+    return {codecvt_base::error, 0, 0};
+  else if (c < 0xE0)
+    len = 2, cp = c & 0x1F;
+  else if (c < 0xF0)
+    {
+      len = 3, cp = c & 0x0F;
+      if (c == 0xE0)
+	lo = 0xA0;
+      else if (c == 0xED)
+	hi = 0x9F;
+    }
+  else if (c < 0xF5)
+    {
+      len = 4, cp = c & 0x07;
+      if (c == 0xF0)
+	lo = 0x90;
+      else if (c == 0xF4)
+	hi = 0x8F;
+    }
+  else
+    return {codecvt_base::error, 0, 0};
+  for (size_t i = 1; i != len; ++i)
+    {
+      if (i == n)
+	return {codecvt_base::partial, 0, 0};
+      if (s[i] < lo || s[i] > hi)
+	return {codecvt_base::error, 0, 0};
+      lo = 0x80, hi = 0xBF;
+      cp = cp << 6 | (s[i] & 0x3F);
+    }
+  return {codecvt_base::ok, len, cp};
+}
+
+// Checks in() and length() on the sequence seq of n bytes against
+// utf8_oracle, once with seq as the whole input and once in the middle of 64
+// bytes of 'b', at an offset that depends on seq, so that the vector paths
+// of the kernels see it too. Calls fail (what) for every failed check and
+// returns their number.
+template <class InternT, class ExternT, class Fail>
+unsigned
+check_utf8_sequence (const codecvt<InternT, ExternT, mbstate_t> &cvt,
+		     codecvt_family family, const unsigned char *seq,
+		     size_t n, Fail &&fail)
+{
+  auto o = utf8_oracle (seq, n);
+  auto valid = o.res == codecvt_base::ok
+	       && (o.cp < 0x10000 || !family_is_bmp_only (family));
+  auto exp_res = valid ? codecvt_base::ok : o.res;
+  if (o.res == codecvt_base::ok && !valid)
+    exp_res = codecvt_base::error;
+  InternT exp[2] = {};
+  size_t exp_len = 0;
+  if (valid && family_intern_is_utf16 (family) && o.cp >= 0x10000)
+    {
+      exp[exp_len++] = InternT (0xD7C0 + (o.cp >> 10));
+      exp[exp_len++] = InternT (0xDC00 + (o.cp & 0x3FF));
+    }
+  else if (valid)
+    exp[exp_len++] = InternT (o.cp);
+
+  auto failures = 0u;
+  const size_t size = 64;
+  ExternT in[size];
+  InternT out[size];
+  auto state = mbstate_t{};
+  auto in_next = (const ExternT *) nullptr;
+  auto out_next = (InternT *) nullptr;
+
+  copy (seq, seq + n, in);
+  auto res = cvt.in (state, in, in + n, in_next, out, out + 4, out_next);
+  if (res != exp_res || in_next != in + (valid ? n : 0)
+      || out_next != out + exp_len || !equal (out, out_next, exp))
+    ++failures, fail ("in()");
+  state = {};
+  if (cvt.length (state, in, in + n, 4) != int (valid ? n : 0))
+    ++failures, fail ("length()");
+
+  auto pos = (n + seq[n - 1]) % 32;
+  fill (in, in + size, ExternT ('b'));
+  copy (seq, seq + n, in + pos);
+  state = {};
+  res = cvt.in (state, in, in + size, in_next, out, out + size, out_next);
+  auto ok = false;
+  if (valid)
+    {
+      auto after = out + pos + exp_len;
+      ok = res == codecvt_base::ok && in_next == in + size
+	   && out_next == after + (size - pos - n)
+	   && all_of (out, out + pos, [] (InternT c) { return c == 'b'; })
+	   && equal (out + pos, after, exp)
+	   && all_of (after, out_next, [] (InternT c) { return c == 'b'; });
+    }
+  else
+    ok = res == codecvt_base::error && in_next == in + pos
+	 && out_next == out + pos
+	 && all_of (out, out + pos, [] (InternT c) { return c == 'b'; });
+  if (!ok)
+    ++failures, fail ("in() inside 'b's");
+  state = {};
+  if (cvt.length (state, in, in + size, size) != int (valid ? size : pos))
+    ++failures, fail ("length() inside 'b's");
+  return failures;
+}
+
+// Calls visit (seq, n) for every case of shard i of test_all_utf8_sequences,
+// the sequences that begin with the bytes i >> 8 and i & 0xFF. A sequence is
+// extended by one more byte, in all 256 ways, only while utf8_oracle says
+// that it is the valid beginning of a longer character. Once a prefix is
+// complete or an error, the bytes that follow belong to the next character.
+// The bytes after the first n are 0.
+template <class Visit>
+void
+for_each_utf8_case (size_t i, Visit &&visit)
+{
+  unsigned char seq[4] = {(unsigned char) (i >> 8), (unsigned char) i};
+  auto extends = [&] (size_t n) {
+    visit (seq, n);
+    return utf8_oracle (seq, n).res == codecvt_base::partial;
+  };
+  if (seq[1] == 0 && !extends (1))
+    return;
+  if (utf8_oracle (seq, 1).res != codecvt_base::partial || !extends (2))
+    return;
+  for (int b2 = 0; b2 != 256; ++b2)
+    {
+      seq[2] = b2;
+      seq[3] = 0;
+      if (extends (3))
+	for (int b3 = 0; b3 != 256; ++b3)
+	  {
+	    seq[3] = b3;
+	    extends (4);
+	  }
+    }
+}
+
+// With --exhaustive: tests every UTF-8 sequence of 1 to 4 bytes, pruned as
+// in for_each_utf8_case, with every facet from for_each_codecvt that
+// converts from UTF-8, see check_utf8_sequence. The pruning leaves about 4.5
+// million of the 2^32 sequences of 4 bytes per facet. The cases are sharded
+// by their first two bytes across a pool with all hardware threads, and the
+// progress and the throughput are printed.
+void
+test_all_utf8_sequences ()
+{
+  const size_t shards = 256 * 256;
+  auto total = size_t (0);
+  for (size_t i = 0; i != shards; ++i)
+    for_each_utf8_case (i, [&] (const unsigned char *, size_t) { ++total; });
+
+  thread_pool pool;
+  for_each_codecvt ([&] (const char *name, codecvt_family family,
+			 const auto &cvt) {
+    if (family != family_utf8_utf32 && family != family_utf8_utf16
+	&& family != family_utf8_ucs2)
+      return;
+    auto t0 = chrono::steady_clock::now ();
+    auto elapsed = [&] {
+      auto t = chrono::steady_clock::now () - t0;
+      return chrono::duration<double> (t).count ();
+    };
+    auto cases = atomic<size_t> (0);
+    auto failures = atomic<unsigned> (0);
+    auto printed = atomic<unsigned> (0);
+    auto next_report = atomic<size_t> (1);
+    pool.parallel_for (shards, [&] (size_t i) {
+      auto shard_cases = size_t (0);
+      auto shard_failures = 0u;
+      for_each_utf8_case (i, [&] (const unsigned char *seq, size_t n) {
+	++shard_cases;
+	shard_failures
+	  += check_utf8_sequence (cvt, family, seq, n, [&] (const char *what) {
+	       if (printed++ < 16)
+		 printf ("%s: %s fails for %02X %02X %02X %02X, %zu bytes\n",
+			 name, what, seq[0], seq[1], seq[2], seq[3], n);
+	     });
+      });
+      failures += shard_failures;
+      auto c = cases += shard_cases;
+      // Every eighth of the cases.
+      auto r = next_report.load ();
+      if (c * 8 >= r * total && next_report.compare_exchange_strong (r, r + 1))
+	printf ("#   %-36s %3zu%% %10zu cases %8.2f Mcases/s\n", name,
+		c * 100 / total, c, c / elapsed () / 1e6);
+    });
+    printf ("# all UTF-8 sequences, %-36s %10zu cases %8u failures "
+	    "%10.1f ms\n",
+	    name, cases.load (), failures.load (), elapsed () * 1e3);
+    VERIFY (failures == 0);
+  });
+}
+
+// Options of the optional tests, set from the command line.
+struct test_options
+{
+  bool exhaustive = false;
+  const char *split_corpus = nullptr; // UTF-8 file for test_split_corpus
+  size_t split_samples = 4096;	      // most split positions per facet
+};
+
+test_options opts;
+
+// Converts from with conv, a lambda that calls in() or out(), in two calls
+// split at position split. The state is carried from the first call to the
+// second, which starts where the first stopped, and the output of the second
+// continues that of the first. Returns true if the result is the same as of
+// a single call, expected, with an ok result.
+template <class FromT, class ToT, class Conv>
+bool
+split_conversion_matches (Conv &&conv, const basic_string<FromT> &from,
+			  const basic_string<ToT> &expected, size_t split)
+{
+  auto out = basic_string<ToT> (expected.size (), 0);
+  auto from_end = from.data () + from.size ();
+  auto out_end = out.data () + out.size ();
+  auto state = mbstate_t{};
+  auto from_next = from.data ();
+  auto to_next = out.data ();
+  auto res = conv (state, from.data (), from.data () + split, from_next,
+		   out.data (), out_end, to_next);
+  if (res != codecvt_base::ok && res != codecvt_base::partial)
+    return false;
+  auto from2 = from_next;
+  auto to2 = to_next;
+  res = conv (state, from2, from_end, from_next, to2, out_end, to_next);
+  return res == codecvt_base::ok && from_next == from_end && to_next == out_end
+	 && out == expected;
+}
 
-  auto &cvt = use_facet<codecvt_c32> (loc_c);
-  test_utf8_utf32_cvt (cvt);
+// With --split-corpus: converts the corpus, a UTF-8 file, with every facet
+// from for_each_codecvt, once in one call and once split in two calls at
+// every position, both with in() and out(). For the UTF-16 families the
+// corpus is first encoded as UTF-16, for the UCS-2 families the code points
+// above the BMP are left out. A corpus with more than --split-samples
+// positions is split at that many random positions. The splits are checked
+// in parallel on a pool with all hardware threads.
+void
+test_split_corpus ()
+{
+  auto file = ifstream (opts.split_corpus, ios::binary);
+  VERIFY (file.is_open ());
+  auto bytes = string (istreambuf_iterator<char> (file), {});
+  auto cps = u32string ();
+  for (size_t i = 0; i != bytes.size ();)
+    {
+      auto p = reinterpret_cast<const unsigned char *> (bytes.data ()) + i;
+      auto o = utf8_oracle (p, bytes.size () - i);
+      if (o.res != codecvt_base::ok)
+	{
+	  printf ("%s: invalid UTF-8 at offset %zu\n", opts.split_corpus, i);
+	  VERIFY (o.res == codecvt_base::ok);
+	  return;
+	}
+      cps += o.cp;
+      i += o.len;
+    }
+
+  thread_pool pool;
+  for_each_codecvt ([&] (const char *name, codecvt_family family,
+			 const auto &cvt) {
+    using intern_type = typename decay_t<decltype (cvt)>::intern_type;
+    using extern_type = typename decay_t<decltype (cvt)>::extern_type;
+    auto t0 = chrono::steady_clock::now ();
+    // The names of the UTF-16 facets end with BE or LE.
+    auto endianess
+      = strstr (name, " LE") ? utf16_little_endian : utf16_big_endian;
+    auto intern = basic_string<intern_type> ();
+    auto ext = basic_string<extern_type> ();
+    for (auto c : cps)
+      if (c < 0x10000 || !family_is_bmp_only (family))
+	{
+	  append_intern (intern, c, family);
+	  append_extern (ext, c, family, endianess);
+	}
+    auto do_in = [&] (auto &&... args) { return cvt.in (args...); };
+    auto do_out = [&] (auto &&... args) { return cvt.out (args...); };
+    auto failures = atomic<unsigned> (0);
+    auto printed = atomic<unsigned> (0);
+    auto check = [&] (size_t split, const char *what, auto &&conv,
+		      const auto &from, const auto &expected) {
+      if (split > from.size ()
+	  || split_conversion_matches (conv, from, expected, split))
+	return;
+      ++failures;
+      if (printed++ < 16)
+	printf ("%s: %s split at %zu differs from one call\n", name, what,
+		split);
+    };
+    check (0, "in()", do_in, ext, intern);
+    check (0, "out()", do_out, intern, ext);
+    // If one call already differs, every split would report it again.
+    if (failures)
+      {
+	printf ("# split corpus, %-36s differs without a split\n", name);
+	VERIFY (failures == 0);
+	return;
+      }
+    auto positions = vector<size_t> ();
+    auto largest = max (ext.size (), intern.size ());
+    if (largest < opts.split_samples)
+      for (size_t i = 1; i <= largest; ++i)
+	positions.push_back (i);
+    else
+      {
+	auto gen = mt19937_64 (largest);
+	auto dist = uniform_int_distribution<size_t> (1, largest);
+	for (size_t i = 0; i != opts.split_samples; ++i)
+	  positions.push_back (dist (gen));
+      }
+    pool.parallel_for (positions.size (), [&] (size_t i) {
+      // Positions past the end of the shorter side are skipped.
+      check (positions[i], "in()", do_in, ext, intern);
+      check (positions[i], "out()", do_out, intern, ext);
+    });
+    auto seconds
+      = chrono::duration<double> (chrono::steady_clock::now () - t0).count ();
+    printf ("# split corpus, %-36s %8zu splits %8u failures %10.1f ms\n",
+	    name, positions.size (), failures.load (), seconds * 1e3);
+    VERIFY (failures == 0);
+  });
+}
+
+// Compares direct_codecvt with the virtual members on every prefix of a
+// string of all kinds of CPs, with a malformed unit at every position and
+// with every output size.
+template <class Facet>
+void
+test_direct_codecvt (const Facet &cvt, codecvt_family family,
+		     utf16_endianess endianess)
+{
+  using InternT = typename Facet::intern_type;
+  using ExternT = typename Facet::extern_type;
+  const codecvt<InternT, ExternT, mbstate_t> &base = cvt;
+  auto direct = direct_codecvt<Facet> (cvt);
+  auto intern = basic_string<InternT> ();
+  auto ext = basic_string<ExternT> ();
+  for (int i = 0; i < 2; ++i)
+    for (auto c : {U'b', U'\u0448', U'\uAAAA', U'\U0010AAAA'})
+      if (c < 0x10000 || !family_is_bmp_only (family))
+	{
+	  append_intern (intern, c, family);
+	  append_extern (ext, c, family, endianess);
+	}
+
+  auto in_inputs = vector<basic_string<ExternT>> ();
+  for (size_t pos = 0; pos <= ext.size (); ++pos)
+    {
+      in_inputs.push_back (ext.substr (0, pos));
+      if (pos == ext.size ())
+	continue;
+      for (auto b : {'\xFF', '\x80', '\xD8', '\xDC'})
+	{
+	  auto bad = ext;
+	  bad[pos] = ExternT (b);
+	  in_inputs.push_back (bad);
+	}
+    }
+  auto out1 = basic_string<InternT> (intern.size (), 0);
+  auto out2 = out1;
+  for (const auto &in : in_inputs)
+    {
+      auto first = in.data ();
+      auto last = first + in.size ();
+      for (size_t size = 0; size <= intern.size (); ++size)
+	{
+	  auto state1 = mbstate_t{}, state2 = mbstate_t{};
+	  auto in_next1 = first, in_next2 = first;
+	  auto out_next1 = out1.data (), out_next2 = out2.data ();
+	  auto res1 = base.in (state1, first, last, in_next1, out1.data (),
+			       out1.data () + size, out_next1);
+	  auto res2 = direct.in (state2, first, last, in_next2, out2.data (),
+				 out2.data () + size, out_next2);
+	  VERIFY (res1 == res2);
+	  VERIFY (in_next1 == in_next2);
+	  VERIFY (out_next1 - out1.data () == out_next2 - out2.data ());
+	  VERIFY (equal (out1.data (), out_next1, out2.data ()));
+	  state1 = {};
+	  state2 = {};
+	  VERIFY (base.length (state1, first, last, size)
+		  == direct.length (state2, first, last, size));
+	}
+    }
 
-  codecvt_utf8<char32_t> cvt2;
-  test_utf8_utf32_cvt (cvt2);
+  auto out_inputs = vector<basic_string<InternT>> ();
+  for (size_t pos = 0; pos <= intern.size (); ++pos)
+    {
+      out_inputs.push_back (intern.substr (0, pos));
+      if (pos == intern.size ())
+	continue;
+      for (auto u : {0xD800, 0xDC00, 0x110000})
+	{
+	  auto bad = intern;
+	  bad[pos] = InternT (u);
+	  out_inputs.push_back (bad);
+	}
+    }
+  auto ext1 = basic_string<ExternT> (ext.size (), 0);
+  auto ext2 = ext1;
+  for (const auto &in : out_inputs)
+    {
+      auto first = in.data ();
+      auto last = first + in.size ();
+      for (size_t size = 0; size <= ext.size (); ++size)
+	{
+	  auto state1 = mbstate_t{}, state2 = mbstate_t{};
+	  auto in_next1 = first, in_next2 = first;
+	  auto out_next1 = ext1.data (), out_next2 = ext2.data ();
+	  auto res1 = base.out (state1, first, last, in_next1, ext1.data (),
+				ext1.data () + size, out_next1);
+	  auto res2 = direct.out (state2, first, last, in_next2, ext2.data (),
+				  ext2.data () + size, out_next2);
+	  VERIFY (res1 == res2);
+	  VERIFY (in_next1 == in_next2);
+	  VERIFY (out_next1 - ext1.data () == out_next2 - ext2.data ());
+	  VERIFY (equal (ext1.data (), out_next1, ext2.data ()));
+	}
+    }
+}
+
+static_assert (direct_codecvt<simd_codecvt_c32>::is_direct);
+static_assert (direct_codecvt<dfa_codecvt_c16>::is_direct);
+static_assert (direct_codecvt<simd_codecvt_utf16<char16_t>>::is_direct);
+static_assert (!direct_codecvt<codecvt_utf8<char32_t>>::is_direct);
+
+// direct_codecvt on every facet, directly on the accelerated ones and
+// through the virtual members on the standard ones.
+void
+test_direct_codecvts ()
+{
+  for_each_codecvt ([] (const char *name, codecvt_family family,
+			const auto &cvt) {
+    auto endianess
+      = strstr (name, " LE") ? utf16_little_endian : utf16_big_endian;
+    test_direct_codecvt (cvt, family, endianess);
+  });
+}
+
+// What in () and out () of the accelerated facets give on a string of all
+// kinds of CPs, long enough for the vectorized paths.
+struct table_conversions
+{
+  codecvt_base::result dfa_res, simd_res, simd16_res, out_res;
+  u32string dfa, simd;
+  u16string simd16;
+  string out;
+};
+
+table_conversions
+convert_with_tables ()
+{
+  auto in = string ();
+  for (int i = 0; i < 8; ++i)
+    in += "b\u0448\uAAAA\U0010AAAA";
+  auto ret = table_conversions ();
+  auto state = mbstate_t{};
+  const char *first = in.data ();
+  const char *last = first + in.size ();
+  auto convert = [&] (const auto &cvt, auto &out) {
+    auto from_next = first;
+    out.assign (in.size (), 0);
+    auto to_next = out.data ();
+    auto res = cvt.in (state, first, last, from_next, out.data (),
+		       out.data () + out.size (), to_next);
+    out.resize (to_next - out.data ());
+    return res;
+  };
+  ret.dfa_res = convert (dfa_codecvt_c32 (), ret.dfa);
+  ret.simd_res = convert (simd_codecvt_c32 (), ret.simd);
+  ret.simd16_res = convert (simd_codecvt_c16 (), ret.simd16);
+  ret.out.assign (in.size (), 0);
+  auto cps_next = (const char32_t *) nullptr;
+  auto to_next = ret.out.data ();
+  ret.out_res = simd_codecvt_c32 ().out (
+    state, ret.simd.data (), ret.simd.data () + ret.simd.size (), cps_next,
+    ret.out.data (), ret.out.data () + ret.out.size (), to_next);
+  ret.out.resize (to_next - ret.out.data ());
+  return ret;
+}
+
+// Done during the static initialization of this translation unit, which
+// can run before that of utf_kernels.cpp.
+const table_conversions static_init_conversions = convert_with_tables ();
+
+// The facets must work during static initialization, see current_level ()
+// in utf_kernels.cpp.
+void
+test_static_init_conversions ()
+{
+  auto &a = static_init_conversions;
+  auto b = convert_with_tables ();
+  VERIFY (a.dfa_res == codecvt_base::ok && a.dfa_res == b.dfa_res);
+  VERIFY (a.dfa == b.dfa && a.dfa.size () == 32 && a.dfa[1] == 0x0448);
+  VERIFY (a.simd_res == codecvt_base::ok && a.simd == b.simd);
+  VERIFY (a.simd16_res == codecvt_base::ok && a.simd16 == b.simd16);
+  VERIFY (a.out_res == codecvt_base::ok && a.out == b.out);
+}
+
+// Many short loops back to back, so that workers often wake up late, after
+// the loop they were woken for has ended. Every index of every loop must
+// still be run exactly once.
+void
+test_thread_pool ()
+{
+  thread_pool pool (4);
+  atomic<unsigned> calls[4];
+  auto wrong = 0u;
+  for (int round = 0; round != 100000; ++round)
+    {
+      auto n = size_t (round % 5);
+      for (auto &c : calls)
+	c = 0;
+      pool.parallel_for (n, [&] (size_t i) { ++calls[i]; });
+      for (size_t i = 0; i != 4; ++i)
+	wrong += calls[i] != (i < n);
+    }
+  VERIFY (wrong == 0);
+}
+
+// A group of tests that can run concurrently with the others, usually one
+// facet in one byte order. The names are the same as in for_each_codecvt.
+struct test_task
+{
+  const char *name;
+  void (*run) ();
+  // The task shards its work across a pool of its own with all hardware
+  // threads, so it runs alone, before the others.
+  bool own_pool = false;
+};
+
+void
+add_utf8_utf32_tasks (vector<test_task> &tasks)
+{
+  using codecvt_c32 = codecvt<char32_t, char, mbstate_t>;
+  tasks.push_back ({"codecvt<char32_t, char>", [] {
+		      auto loc_c = locale::classic ();
+		      VERIFY (has_facet<codecvt_c32> (loc_c));
+		      auto &cvt = use_facet<codecvt_c32> (loc_c);
+		      test_utf8_utf32_cvt (cvt);
+		      test_length_bulk (cvt);
+		      thread_pool pool (4);
+		      test_parallel_utf8_in (cvt, pool);
+		    }});
+
+  tasks.push_back ({"codecvt_utf8<char32_t>", [] {
+		      codecvt_utf8<char32_t> cvt;
+		      test_utf8_utf32_cvt (cvt);
+		    }});
 
 #if __SIZEOF_WCHAR_T__ == 4
-  codecvt_utf8<wchar_t> cvt3;
-  test_utf8_utf32_cvt (cvt3);
+  tasks.push_back ({"codecvt_utf8<wchar_t>", [] {
+		      codecvt_utf8<wchar_t> cvt;
+		      test_utf8_utf32_cvt (cvt);
+		    }});
 #endif
 
 #ifdef __cpp_char8_t
-  using codecvt_c32_c8 = codecvt<char32_t, char8_t, mbstate_t>;
-  VERIFY (has_facet<codecvt_c32_c8> (loc_c));
-  auto &cvt4 = use_facet<codecvt_c32_c8> (loc_c);
-  test_utf8_utf32_cvt (cvt4);
+  tasks.push_back ({"codecvt<char32_t, char8_t>", [] {
+		      using codecvt_c32_c8
+			= codecvt<char32_t, char8_t, mbstate_t>;
+		      auto loc_c = locale::classic ();
+		      VERIFY (has_facet<codecvt_c32_c8> (loc_c));
+		      auto &cvt = use_facet<codecvt_c32_c8> (loc_c);
+		      test_utf8_utf32_cvt (cvt);
+		    }});
 #endif
+
+  tasks.push_back ({"simd_codecvt_c32", [] {
+		      simd_codecvt_c32 cvt;
+		      for_each_kernel_level ([&] {
+			test_utf8_utf32_cvt (cvt);
+			test_length_bulk (cvt);
+		      });
+		      thread_pool pool (4);
+		      test_parallel_utf8_in (cvt, pool);
+
+		      auto &loc = registered_locale<simd_codecvt_c32> ();
+		      VERIFY (has_facet<codecvt_c32> (loc));
+		      auto &cvt2 = registered_facet<simd_codecvt_c32> ();
+		      VERIFY (&use_facet<codecvt_c32> (loc) == &cvt2);
+		      VERIFY (&registered_locale<simd_codecvt_c32> () == &loc);
+		      test_utf8_utf32_cvt (cvt2);
+		    }});
+
+  tasks.push_back ({"dfa_codecvt_c32", [] {
+		      dfa_codecvt_c32 cvt;
+		      for_each_kernel_level ([&] {
+			test_utf8_utf32_cvt (cvt);
+			test_length_bulk (cvt);
+		      });
+		    }});
 }
 
 void
-test_utf8_utf16_codecvts ()
+add_utf8_utf16_tasks (vector<test_task> &tasks)
 {
-  using codecvt_c16 = codecvt<char16_t, char, mbstate_t>;
-  auto loc_c = locale::classic ();
-  VERIFY (has_facet<codecvt_c16> (loc_c));
-
-  auto &cvt = use_facet<codecvt_c16> (loc_c);
-  test_utf8_utf16_cvt (cvt);
-
-  codecvt_utf8_utf16<char16_t> cvt2;
-  test_utf8_utf16_cvt (cvt2);
-
-  codecvt_utf8_utf16<char32_t> cvt3;
-  test_utf8_utf16_cvt (cvt3);
+  tasks.push_back ({"codecvt<char16_t, char>", [] {
+		      using codecvt_c16 = codecvt<char16_t, char, mbstate_t>;
+		      auto loc_c = locale::classic ();
+		      VERIFY (has_facet<codecvt_c16> (loc_c));
+		      auto &cvt = use_facet<codecvt_c16> (loc_c);
+		      test_utf8_utf16_cvt (cvt);
+		      test_length_bulk (cvt);
+		      test_utf8_utf16_length_long (cvt);
+		      thread_pool pool (4);
+		      test_parallel_utf8_in (cvt, pool);
+		    }});
+
+  tasks.push_back ({"codecvt_utf8_utf16<char16_t>", [] {
+		      codecvt_utf8_utf16<char16_t> cvt;
+		      test_utf8_utf16_cvt (cvt);
+		    }});
+
+  tasks.push_back ({"codecvt_utf8_utf16<char32_t>", [] {
+		      codecvt_utf8_utf16<char32_t> cvt;
+		      test_utf8_utf16_cvt (cvt);
+		    }});
 
 #if _WIN32 || __SIZEOF_WCHAR_T__ >= 2
-  codecvt_utf8_utf16<wchar_t> cvt4;
-  test_utf8_utf16_cvt (cvt4);
+  tasks.push_back ({"codecvt_utf8_utf16<wchar_t>", [] {
+		      codecvt_utf8_utf16<wchar_t> cvt;
+		      test_utf8_utf16_cvt (cvt);
+		    }});
 #endif
 
 #ifdef __cpp_char8_t
-  using codecvt_c16_c8 = codecvt<char16_t, char8_t, mbstate_t>;
-  VERIFY (has_facet<codecvt_c16_c8> (loc_c));
-  auto &cvt5 = use_facet<codecvt_c16_c8> (loc_c);
-  test_utf8_utf16_cvt (cvt5);
+  tasks.push_back ({"codecvt<char16_t, char8_t>", [] {
+		      using codecvt_c16_c8
+			= codecvt<char16_t, char8_t, mbstate_t>;
+		      auto loc_c = locale::classic ();
+		      VERIFY (has_facet<codecvt_c16_c8> (loc_c));
+		      auto &cvt = use_facet<codecvt_c16_c8> (loc_c);
+		      test_utf8_utf16_cvt (cvt);
+		    }});
 #endif
+
+  tasks.push_back ({"simd_codecvt_c16", [] {
+		      simd_codecvt_c16 cvt;
+		      for_each_kernel_level ([&] {
+			test_utf8_utf16_cvt (cvt);
+			test_length_bulk (cvt);
+			test_utf8_utf16_length_long (cvt);
+		      });
+		      thread_pool pool (4);
+		      test_parallel_utf8_in (cvt, pool);
+		    }});
+
+  tasks.push_back ({"dfa_codecvt_c16", [] {
+		      dfa_codecvt_c16 cvt;
+		      for_each_kernel_level ([&] {
+			test_utf8_utf16_cvt (cvt);
+			test_length_bulk (cvt);
+			test_utf8_utf16_length_long (cvt);
+		      });
+		    }});
 }
 
 void
-test_utf8_ucs2_codecvts ()
+add_utf8_ucs2_tasks (vector<test_task> &tasks)
 {
-  codecvt_utf8<char16_t> cvt;
-  test_utf8_ucs2_cvt (cvt);
+  tasks.push_back ({"codecvt_utf8<char16_t>", [] {
+		      codecvt_utf8<char16_t> cvt;
+		      test_utf8_ucs2_cvt (cvt);
+		    }});
 
 #if _WIN32 || __SIZEOF_WCHAR_T__ == 2
-  codecvt_utf8<wchar_t> cvt2;
-  test_utf8_ucs2_cvt (cvt2);
+  tasks.push_back ({"codecvt_utf8<wchar_t>", [] {
+		      codecvt_utf8<wchar_t> cvt;
+		      test_utf8_ucs2_cvt (cvt);
+		    }});
 #endif
 }
 
 void
-test_utf16_utf32_codecvts ()
+add_utf16_utf32_tasks (vector<test_task> &tasks)
 {
-  codecvt_utf16<char32_t> cvt;
-  test_utf16_utf32_cvt (cvt, utf16_big_endian);
-
-  codecvt_utf16<char32_t, 0x10FFFF, codecvt_mode::little_endian> cvt2;
-  test_utf16_utf32_cvt (cvt2, utf16_little_endian);
+  tasks.push_back ({"codecvt_utf16<char32_t> BE", [] {
+		      codecvt_utf16<char32_t> cvt;
+		      test_utf16_utf32_cvt (cvt, utf16_big_endian);
+		      thread_pool pool (4);
+		      test_parallel_utf16_in (cvt, pool, utf16_big_endian);
+		    }});
+
+  tasks.push_back ({"codecvt_utf16<char32_t> LE", [] {
+		      codecvt_utf16<char32_t, 0x10FFFF, little_endian> cvt;
+		      test_utf16_utf32_cvt (cvt, utf16_little_endian);
+		      thread_pool pool (4);
+		      test_parallel_utf16_in (cvt, pool, utf16_little_endian);
+		    }});
 
 #if __SIZEOF_WCHAR_T__ == 4
-  codecvt_utf16<wchar_t> cvt3;
-  test_utf16_utf32_cvt (cvt3, utf16_big_endian);
-
-  codecvt_utf16<wchar_t, 0x10FFFF, codecvt_mode::little_endian> cvt4;
-  test_utf16_utf32_cvt (cvt4, utf16_little_endian);
+  tasks.push_back ({"codecvt_utf16<wchar_t> BE", [] {
+		      codecvt_utf16<wchar_t> cvt;
+		      test_utf16_utf32_cvt (cvt, utf16_big_endian);
+		    }});
+
+  tasks.push_back ({"codecvt_utf16<wchar_t> LE", [] {
+		      codecvt_utf16<wchar_t, 0x10FFFF, little_endian> cvt;
+		      test_utf16_utf32_cvt (cvt, utf16_little_endian);
+		    }});
 #endif
+
+  tasks.push_back ({"simd_codecvt_utf16<char32_t> BE", [] {
+		      simd_codecvt_utf16<char32_t> cvt;
+		      for_each_kernel_level ([&] {
+			test_utf16_utf32_cvt (cvt, utf16_big_endian);
+		      });
+		      thread_pool pool (4);
+		      test_parallel_utf16_in (cvt, pool, utf16_big_endian);
+		    }});
+
+  tasks.push_back ({"simd_codecvt_utf16<char32_t> LE", [] {
+		      simd_codecvt_utf16<char32_t, little_endian> cvt;
+		      for_each_kernel_level ([&] {
+			test_utf16_utf32_cvt (cvt, utf16_little_endian);
+		      });
+		      thread_pool pool (4);
+		      test_parallel_utf16_in (cvt, pool, utf16_little_endian);
+		    }});
 }
 
 void
-test_utf16_ucs2_codecvts ()
+add_utf16_ucs2_tasks (vector<test_task> &tasks)
 {
-  codecvt_utf16<char16_t> cvt;
-  test_utf16_ucs2_cvt (cvt, utf16_big_endian);
-
-  codecvt_utf16<char16_t, 0x10FFFF, codecvt_mode::little_endian> cvt2;
-  test_utf16_ucs2_cvt (cvt2, utf16_little_endian);
+  tasks.push_back ({"codecvt_utf16<char16_t> BE", [] {
+		      codecvt_utf16<char16_t> cvt;
+		      test_utf16_ucs2_cvt (cvt, utf16_big_endian);
+		      thread_pool pool (4);
+		      test_parallel_utf16_in (cvt, pool, utf16_big_endian);
+		    }});
+
+  tasks.push_back ({"codecvt_utf16<char16_t> LE", [] {
+		      codecvt_utf16<char16_t, 0x10FFFF, little_endian> cvt;
+		      test_utf16_ucs2_cvt (cvt, utf16_little_endian);
+		      thread_pool pool (4);
+		      test_parallel_utf16_in (cvt, pool, utf16_little_endian);
+		    }});
 
 #if __SIZEOF_WCHAR_T__ == 2
-  codecvt_utf16<wchar_t> cvt3;
-  test_utf16_ucs2_cvt (cvt3, utf16_big_endian);
-
-  codecvt_utf16<wchar_t, 0x10FFFF, codecvt_mode::little_endian> cvt4;
-  test_utf16_ucs2_cvt (cvt4, utf16_little_endian);
+  tasks.push_back ({"codecvt_utf16<wchar_t> BE", [] {
+		      codecvt_utf16<wchar_t> cvt;
+		      test_utf16_ucs2_cvt (cvt, utf16_big_endian);
+		    }});
+
+  tasks.push_back ({"codecvt_utf16<wchar_t> LE", [] {
+		      codecvt_utf16<wchar_t, 0x10FFFF, little_endian> cvt;
+		      test_utf16_ucs2_cvt (cvt, utf16_little_endian);
+		    }});
 #endif
+
+  tasks.push_back ({"simd_codecvt_utf16<char16_t> BE", [] {
+		      simd_codecvt_utf16<char16_t> cvt;
+		      for_each_kernel_level ([&] {
+			test_utf16_ucs2_cvt (cvt, utf16_big_endian);
+		      });
+		      thread_pool pool (4);
+		      test_parallel_utf16_in (cvt, pool, utf16_big_endian);
+		    }});
+
+  tasks.push_back ({"simd_codecvt_utf16<char16_t> LE", [] {
+		      simd_codecvt_utf16<char16_t, little_endian> cvt;
+		      for_each_kernel_level ([&] {
+			test_utf16_ucs2_cvt (cvt, utf16_little_endian);
+		      });
+		      thread_pool pool (4);
+		      test_parallel_utf16_in (cvt, pool, utf16_little_endian);
+		    }});
+}
+
+// Runs the tasks on all hardware threads and prints the number of failed
+// VERIFYs and the wall-clock time of every task. Returns the total number of
+// failures. Tasks with their own pool run one after another on the calling
+// thread, so that the threads are not oversubscribed.
+unsigned
+run_test_tasks (const vector<test_task> &tasks)
+{
+  struct task_result
+  {
+    unsigned errors;
+    double seconds;
+  };
+  auto results = vector<task_result> (tasks.size ());
+  auto run = [&] (size_t i) {
+    auto errors = thread_errors;
+    auto t0 = chrono::steady_clock::now ();
+    tasks[i].run ();
+    auto t1 = chrono::steady_clock::now ();
+    results[i] = {thread_errors - errors,
+		  chrono::duration<double> (t1 - t0).count ()};
+  };
+  auto shared = vector<size_t> ();
+  for (size_t i = 0; i != tasks.size (); ++i)
+    if (tasks[i].own_pool)
+      run (i);
+    else
+      shared.push_back (i);
+  thread_pool pool;
+  pool.parallel_for (shared.size (), [&] (size_t k) { run (shared[k]); });
+  auto total = 0u;
+  for (size_t i = 0; i != tasks.size (); ++i)
+    {
+      printf ("# %-36s %6u failures %10.1f ms\n", tasks[i].name,
+	      results[i].errors, results[i].seconds * 1e3);
+      total += results[i].errors;
+    }
+  printf ("# %u tasks on %u threads, %u failures\n", unsigned (tasks.size ()),
+	  pool.size (), total);
+  return total;
 }
 
 int
-main ()
-{
-  test_utf8_utf32_codecvts ();
-  test_utf8_utf16_codecvts ();
-  test_utf8_ucs2_codecvts ();
-  test_utf16_utf32_codecvts ();
-  test_utf16_ucs2_codecvts ();
-  return global_error;
+main (int argc, char *argv[])
+{
+  for (int i = 1; i < argc; ++i)
+    {
+      auto a = argv[i];
+      if (strcmp (a, "--exhaustive") == 0)
+	opts.exhaustive = true;
+      else if (strncmp (a, "--split-corpus=", 15) == 0)
+	opts.split_corpus = a + 15;
+      else if (strncmp (a, "--split-samples=", 16) == 0)
+	opts.split_samples = strtoul (a + 16, nullptr, 10);
+      else
+	{
+	  printf (
+	    "Usage: %s [options]\n"
+	    "  --exhaustive        also test every code point and every UTF-8\n"
+	    "                      sequence up to 4 bytes with every facet\n"
+	    "  --split-corpus=F    also convert the UTF-8 file F split in two\n"
+	    "                      calls at every position with every facet\n"
+	    "  --split-samples=N   split at N random positions if there are\n"
+	    "                      more (default 4096)\n",
+	    argv[0]);
+	  return 2;
+	}
+    }
+
+  auto tasks = vector<test_task> ();
+  if (opts.exhaustive)
+    {
+      tasks.push_back ({"all code points", test_all_code_points, true});
+      tasks.push_back (
+	{"all UTF-8 sequences", test_all_utf8_sequences, true});
+    }
+  if (opts.split_corpus)
+    tasks.push_back ({"split corpus", test_split_corpus, true});
+  add_utf8_utf32_tasks (tasks);
+  add_utf8_utf16_tasks (tasks);
+  add_utf8_ucs2_tasks (tasks);
+  add_utf16_utf32_tasks (tasks);
+  add_utf16_ucs2_tasks (tasks);
+  tasks.push_back ({"direct_codecvt", test_direct_codecvts});
+  tasks.push_back ({"static initialization", test_static_init_conversions});
+  tasks.push_back ({"thread_pool", test_thread_pool});
+  return run_test_tasks (tasks) != 0;
 }
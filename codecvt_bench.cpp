@@ -0,0 +1,1258 @@
+// Copyright 2020-2023 Dimitrij Mijoski
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "codecvt_facets.h"
+#include "codecvt_length.h"
+#include "corpus_generator.h"
+#include "direct_codecvt.h"
+#include "locale_registry.h"
+#include "perf_counters.h"
+#include "utf_kernels.h"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC 1
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define BENCH_HAVE_TSC 1
+#endif
+
+using namespace std;
+
+enum sweep_series
+{
+  sweep_in_buffer,
+  sweep_out_buffer,
+  sweep_both_buffers
+};
+
+struct bench_options
+{
+  size_t corpus_size = 8 << 20; // bytes of UTF-8
+  double min_time = 0.2;	// seconds per measurement
+  const char *filter = nullptr; // substring of the facet name
+  size_t max_chunk = 1 << 20;	// largest buffer size in the chunk sweep
+  sweep_series series = sweep_both_buffers;
+  unsigned threads = max (thread::hardware_concurrency (), 1u);
+  bool generated = false; // corpus from corpus_generator.h
+  corpus_preset preset = corpus_presets[0];
+  uint64_t seed = 1;
+  bool counters = false; // read hardware counters around every call
+  size_t calls = 1000000; // timed calls per direction in the latency mode
+};
+
+bench_options opts;
+
+bool
+facet_selected (const char *name)
+{
+  return !opts.filter || strstr (name, opts.filter);
+}
+
+// Code points used by the tests: 1-byte, 2-byte, 3-byte and 4-byte in UTF-8.
+const char32_t test_cps[] = {U'b', 0x0448, 0xAAAA, 0x10AAAA};
+
+// Builds a sequence of code points that is about size bytes in UTF-8 by
+// repeating the test code points, or with --corpus from corpus_generator.h.
+// For the UCS-2 families the 4-byte code points are left out.
+u32string
+make_code_points (codecvt_family family, size_t size)
+{
+  if (opts.generated)
+    return generate_corpus (opts.preset, size, opts.seed,
+			    family_is_bmp_only (family));
+  auto n = family_is_bmp_only (family) ? 3 : 4;
+  auto pattern_size = family_is_bmp_only (family) ? 6 : 10;
+  auto ret = u32string ();
+  ret.reserve (size / pattern_size * n + n);
+  for (size_t i = 0; i < size / pattern_size; ++i)
+    ret.append (test_cps, n);
+  return ret;
+}
+
+// Encodes code points as UTF-32 or UTF-16 code units of type InternT.
+template <class InternT>
+basic_string<InternT>
+encode_intern (const u32string &cps, bool utf16)
+{
+  auto ret = basic_string<InternT> ();
+  ret.reserve (cps.size () * (utf16 ? 2 : 1));
+  for (auto c : cps)
+    if (utf16 && c >= 0x10000)
+      {
+	c -= 0x10000;
+	ret.push_back (InternT (0xD800 + (c >> 10)));
+	ret.push_back (InternT (0xDC00 + (c & 0x3FF)));
+      }
+    else
+      ret.push_back (InternT (c));
+  return ret;
+}
+
+// Converts the whole intern string to extern with out(). Returns empty string
+// on failure.
+template <class InternT, class ExternT>
+basic_string<ExternT>
+encode_extern (const codecvt<InternT, ExternT, mbstate_t> &cvt,
+	       const basic_string<InternT> &intern)
+{
+  auto ret = basic_string<ExternT> (intern.size () * cvt.max_length (), 0);
+  auto state = mbstate_t{};
+  auto in_next = (const InternT *) nullptr;
+  auto out_next = (ExternT *) nullptr;
+  auto res = cvt.out (state, intern.data (), intern.data () + intern.size (),
+		      in_next, ret.data (), ret.data () + ret.size (), out_next);
+  if (res != cvt.ok || in_next != intern.data () + intern.size ())
+    return {};
+  ret.resize (out_next - ret.data ());
+  return ret;
+}
+
+// The counters of the benchmarks, opened on first use.
+perf_counter_group &
+bench_counters ()
+{
+  static perf_counter_group group;
+  return group;
+}
+
+// Runs f repeatedly for at least opts.min_time seconds and returns the
+// fastest run in seconds. With --counters, counts gets the hardware counters
+// averaged over the runs. The counters are started before the clock and
+// stopped after it, so they do not add to the time.
+template <class Func>
+double
+time_best (Func &&f, perf_counts *counts = nullptr)
+{
+  auto group = counts && opts.counters ? &bench_counters () : nullptr;
+  auto sum = perf_counts ();
+  using clock = chrono::steady_clock;
+  auto best = 1e300;
+  auto total = 0.0;
+  auto runs = 0;
+  while (total < opts.min_time || runs < 3)
+    {
+      if (group)
+	group->start ();
+      auto t0 = clock::now ();
+      f ();
+      auto t = chrono::duration<double> (clock::now () - t0).count ();
+      if (group)
+	group->stop (sum);
+      best = min (best, t);
+      total += t;
+      ++runs;
+    }
+  if (group)
+    for (int i = 0; i != perf_counter_count; ++i)
+      {
+	counts->value[i] = sum.value[i] / runs;
+	counts->valid[i] = sum.valid[i];
+      }
+  return best;
+}
+
+// Keeps the optimizer from discarding a computed value.
+template <class T>
+void
+do_not_optimize (const T &v)
+{
+#ifdef __GNUC__
+  asm volatile ("" : : "g"(&v) : "memory");
+#else
+  static const void *volatile sink;
+  sink = &v;
+#endif
+}
+
+void
+print_result (const char *name, const char *dir, size_t bytes, size_t cps,
+	      double seconds)
+{
+  printf ("%-32s %-4s %10.1f MB/s %10.1f Mcp/s\n", name, dir,
+	  bytes / seconds / 1e6, cps / seconds / 1e6);
+}
+
+// Prints the counters of one call over bytes bytes and cps code points,
+// normalized so that corpora of any size compare. Counters that could not
+// be read are printed as "-".
+void
+print_counts (const char *name, const char *what, const perf_counts &c,
+	      size_t bytes, size_t cps)
+{
+  if (!opts.counters)
+    return;
+  auto print = [&] (bool valid, double v, const char *unit) {
+    if (valid)
+      printf (" %8.3f %s", v, unit);
+    else
+      printf (" %8s %s", "-", unit);
+  };
+  auto &v = c.value;
+  auto &ok = c.valid;
+  printf ("%-32s %-4s", name, what);
+  print (ok[perf_cycles], v[perf_cycles] / bytes, "cycles/B");
+  print (ok[perf_instructions], v[perf_instructions] / bytes, "instr/B");
+  print (ok[perf_cycles] && ok[perf_instructions],
+	 v[perf_instructions] / v[perf_cycles], "IPC");
+  print (ok[perf_branch_misses], v[perf_branch_misses] / cps * 1000,
+	 "br-miss/kcp");
+  print (ok[perf_l1d_misses], v[perf_l1d_misses] / bytes * 1024,
+	 "L1D-miss/KiB");
+  print (ok[perf_llc_misses], v[perf_llc_misses] / bytes * 1024,
+	 "LLC-miss/KiB");
+  printf ("\n");
+}
+
+// Fastest in() of all of ext and out() of all of intern, in one call each,
+// in seconds. in_ok and out_ok tell if they reproduced the other string.
+struct in_out_times
+{
+  double in, out;
+  bool in_ok, out_ok;
+  perf_counts in_counts, out_counts; // with --counters
+};
+
+template <class InternT, class ExternT>
+in_out_times
+time_in_out (const codecvt<InternT, ExternT, mbstate_t> &cvt,
+	     const basic_string<InternT> &intern,
+	     const basic_string<ExternT> &ext)
+{
+  auto ret = in_out_times{0, 0, true, true, {}, {}};
+  auto out_buf = basic_string<InternT> (intern.size (), 0);
+  ret.in = time_best ([&] {
+    auto state = mbstate_t{};
+    auto in_next = (const ExternT *) nullptr;
+    auto out_next = (InternT *) nullptr;
+    auto res
+      = cvt.in (state, ext.data (), ext.data () + ext.size (), in_next,
+		out_buf.data (), out_buf.data () + out_buf.size (), out_next);
+    ret.in_ok = ret.in_ok && res == cvt.ok;
+    do_not_optimize (out_next);
+  }, &ret.in_counts);
+  ret.in_ok = ret.in_ok && out_buf == intern;
+
+  auto ext_buf = basic_string<ExternT> (ext.size (), 0);
+  ret.out = time_best ([&] {
+    auto state = mbstate_t{};
+    auto in_next = (const InternT *) nullptr;
+    auto out_next = (ExternT *) nullptr;
+    auto res = cvt.out (state, intern.data (), intern.data () + intern.size (),
+			in_next, ext_buf.data (),
+			ext_buf.data () + ext_buf.size (), out_next);
+    ret.out_ok = ret.out_ok && res == cvt.ok;
+    do_not_optimize (out_next);
+  }, &ret.out_counts);
+  ret.out_ok = ret.out_ok && ext_buf == ext;
+  return ret;
+}
+
+// Measures in() and out() over the whole corpus in one call each.
+template <class InternT, class ExternT>
+void
+bench_throughput (const char *name, codecvt_family family,
+		  const codecvt<InternT, ExternT, mbstate_t> &cvt)
+{
+  auto cps = make_code_points (family, opts.corpus_size);
+  auto intern = encode_intern<InternT> (cps, family_intern_is_utf16 (family));
+  auto ext = encode_extern (cvt, intern);
+  if (ext.empty ())
+    {
+      printf ("%-32s out() failed on the corpus\n", name);
+      return;
+    }
+  auto bytes = ext.size () * sizeof (ExternT);
+  auto t = time_in_out (cvt, intern, ext);
+  if (!t.in_ok)
+    printf ("%-32s in() did not round-trip the corpus\n", name);
+  print_result (name, "in", bytes, cps.size (), t.in);
+  print_counts (name, "in", t.in_counts, bytes, cps.size ());
+  if (!t.out_ok)
+    printf ("%-32s out() did not round-trip the corpus\n", name);
+  print_result (name, "out", bytes, cps.size (), t.out);
+  print_counts (name, "out", t.out_counts, bytes, cps.size ());
+}
+
+// Cycles per second of the clock that the classes mode reports in and the
+// latency mode reads. On x86 it is the time stamp counter, calibrated
+// against steady_clock once. The counter ticks at the nominal frequency of
+// the CPU, so with turbo or power saving the core cycles differ from it by
+// the same factor for all facets. Elsewhere it is steady_clock in
+// nanoseconds.
+#ifdef BENCH_HAVE_TSC
+const char *const cycle_unit = "cycles";
+
+// The fences keep the timed code from moving across the reading.
+inline uint64_t
+read_cycles ()
+{
+  _mm_lfence ();
+  auto c = __rdtsc ();
+  _mm_lfence ();
+  return c;
+}
+
+double
+cycles_per_second ()
+{
+  static const auto hz = [] {
+    using clock = chrono::steady_clock;
+    auto t0 = clock::now ();
+    auto c0 = __rdtsc ();
+    while (clock::now () - t0 < chrono::milliseconds (50))
+      ;
+    auto c1 = __rdtsc ();
+    auto t = chrono::duration<double> (clock::now () - t0).count ();
+    return (c1 - c0) / t;
+  }();
+  return hz;
+}
+#else
+const char *const cycle_unit = "ns";
+
+inline uint64_t
+read_cycles ()
+{
+  auto t = chrono::steady_clock::now ().time_since_epoch ();
+  return chrono::duration_cast<chrono::nanoseconds> (t).count ();
+}
+
+double
+cycles_per_second ()
+{
+  return 1e9;
+}
+#endif
+
+// Measures every length class of the code points alone, then all classes
+// mixed with the same number of code points of each. There are
+// corpus_size / 10 code points per class, corpus_size / 6 for UCS-2, so the
+// mixed streams are corpus_size bytes of UTF-8. "sum" is the cost of the
+// mixed streams if switching classes was free, the sum of the homogeneous
+// streams. "cyclic" repeats the test code points in order, a pattern the
+// branch predictor learns. "shuffled" has the same code points in random
+// order, every switch of class there is a likely misprediction.
+template <class InternT, class ExternT>
+void
+bench_classes (const char *name, codecvt_family family,
+	       const codecvt<InternT, ExternT, mbstate_t> &cvt)
+{
+  auto classes = family_is_bmp_only (family) ? 3 : 4;
+  auto n = opts.corpus_size / (classes == 3 ? 6 : 10);
+  auto utf16 = family_intern_is_utf16 (family);
+  auto hz = cycles_per_second ();
+  auto row = [&] (const char *stream, const u32string &cps, double *sum) {
+    auto intern = encode_intern<InternT> (cps, utf16);
+    auto ext = encode_extern (cvt, intern);
+    if (ext.empty ())
+      {
+	printf ("# %s: out() failed on the %s stream\n", name, stream);
+	return;
+      }
+    auto t = time_in_out (cvt, intern, ext);
+    if (!t.in_ok || !t.out_ok)
+      printf ("# %s: no round-trip of the %s stream\n", name, stream);
+    if (sum)
+      {
+	sum[0] += t.in;
+	sum[1] += t.out;
+	sum[2] += ext.size () * sizeof (ExternT);
+      }
+    auto bytes = double (ext.size () * sizeof (ExternT));
+    printf ("  %-10s %12.3f %12.3f %12.3f %12.3f\n", stream,
+	    t.in * hz / cps.size (), t.in * hz / bytes,
+	    t.out * hz / cps.size (), t.out * hz / bytes);
+    auto label = string ("# ") + stream;
+    print_counts (label.c_str (), "in", t.in_counts, bytes, cps.size ());
+    print_counts (label.c_str (), "out", t.out_counts, bytes, cps.size ());
+  };
+
+  printf ("# %s, %zu code points per class\n", name, n);
+  printf ("# %s per code point and per byte of the external encoding\n",
+	  cycle_unit);
+  printf ("# %-10s %9s/cp %7s/byte %9s/cp %7s/byte\n", "stream", "in",
+	  "in", "out", "out");
+  double sum[3] = {};
+  const char *const class_names[] = {"1-byte", "2-byte", "3-byte", "4-byte"};
+  for (int k = 0; k < classes; ++k)
+    row (class_names[k], u32string (n, test_cps[k]), sum);
+  auto total = n * classes;
+  printf ("  %-10s %12.3f %12.3f %12.3f %12.3f\n", "sum",
+	  sum[0] * hz / total, sum[0] * hz / sum[2], sum[1] * hz / total,
+	  sum[1] * hz / sum[2]);
+
+  auto mixed = u32string ();
+  mixed.reserve (total);
+  for (size_t i = 0; i != n; ++i)
+    mixed.append (test_cps, classes);
+  row ("cyclic", mixed, nullptr);
+  // Fisher-Yates with the generator of the corpora, so that every run and
+  // every platform shuffle the same way.
+  auto rng = corpus_random (opts.seed);
+  for (auto i = mixed.size (); i > 1; --i)
+    swap (mixed[i - 1], mixed[rng.next () % i]);
+  row ("shuffled", mixed, nullptr);
+  printf ("\n\n");
+}
+
+// Histogram of latencies in the manner of HdrHistogram. Values below 128
+// have a bucket each, above that every power of two is split in 64 buckets,
+// so a percentile is off by less than 1/64 of its value at any magnitude.
+// Recording is a few instructions and does not allocate.
+class latency_histogram
+{
+public:
+  latency_histogram () : buckets (64 * 59) {}
+
+  void
+  record (uint64_t v)
+  {
+    ++buckets[index (v)];
+    ++count;
+    max_value = std::max (max_value, v);
+  }
+
+  uint64_t
+  max () const
+  {
+    return max_value;
+  }
+
+  // The highest value that is in the same bucket as the value at the
+  // percentile p, in [0, 100].
+  uint64_t
+  percentile (double p) const
+  {
+    auto rank = uint64_t (p / 100 * count + 0.5);
+    rank = std::max<uint64_t> (1, std::min (rank, count));
+    uint64_t seen = 0;
+    for (size_t i = 0; i != buckets.size (); ++i)
+      {
+	seen += buckets[i];
+	if (seen >= rank)
+	  return std::min (highest_in_bucket (i), max_value);
+      }
+    return max_value;
+  }
+
+private:
+  static size_t
+  index (uint64_t v)
+  {
+    if (v < 128)
+      return v;
+    auto shift = bit_width (v) - 7;
+    return 64 * shift + (v >> shift);
+  }
+
+  static uint64_t
+  highest_in_bucket (size_t i)
+  {
+    if (i < 128)
+      return i;
+    auto shift = i / 64 - 1;
+    return ((i % 64 + 64 + 1) << shift) - 1;
+  }
+
+  vector<uint64_t> buckets;
+  uint64_t count = 0;
+  uint64_t max_value = 0;
+};
+
+// Shortest and longest inputs of the latency mode, in bytes.
+const size_t latency_min_bytes = 4;
+const size_t latency_max_bytes = 64;
+
+// Short strings cut from the corpus at character boundaries, in both
+// encodings, stored one after another.
+template <class InternT, class ExternT>
+struct short_strings
+{
+  basic_string<InternT> intern;
+  basic_string<ExternT> ext;
+  vector<size_t> intern_begin, ext_begin; // one more than the strings
+};
+
+// The corpus must not be empty.
+template <class InternT, class ExternT>
+short_strings<InternT, ExternT>
+cut_short_strings (const codecvt<InternT, ExternT, mbstate_t> &cvt,
+		   const u32string &cps, bool utf16, size_t n)
+{
+  auto ret = short_strings<InternT, ExternT> ();
+  ret.intern_begin.push_back (0);
+  ret.ext_begin.push_back (0);
+  auto rng = corpus_random (opts.seed);
+  for (size_t i = 0; i != n; ++i)
+    {
+      auto span = latency_max_bytes - latency_min_bytes + 1;
+      auto target = latency_min_bytes + rng.next () % span;
+      auto first = rng.next () % cps.size ();
+      auto intern = basic_string<InternT> ();
+      auto ext = basic_string<ExternT> ();
+      // Grows the string while it fits, at least one code point.
+      for (auto last = first + 1; last <= cps.size (); ++last)
+	{
+	  auto next_intern = encode_intern<InternT> (
+	    cps.substr (first, last - first), utf16);
+	  auto next_ext = encode_extern (cvt, next_intern);
+	  if (!ext.empty () && next_ext.size () * sizeof (ExternT) > target)
+	    break;
+	  intern = move (next_intern);
+	  ext = move (next_ext);
+	  if (ext.size () * sizeof (ExternT) >= target)
+	    break;
+	}
+      ret.intern += intern;
+      ret.ext += ext;
+      ret.intern_begin.push_back (ret.intern.size ());
+      ret.ext_begin.push_back (ret.ext.size ());
+    }
+  return ret;
+}
+
+// Times opts.calls individual calls of in() and of out(), every one on a
+// string of 4 to 64 bytes cut from the corpus, cycling over 4096 of them.
+// The cost of reading the clock, the smallest time of an empty measurement,
+// is subtracted. Prints percentiles of the latency in nanoseconds. At these
+// sizes the virtual call and the setup of a conversion weigh as much as the
+// conversion itself, which the throughput of long strings does not show.
+template <class InternT, class ExternT>
+void
+bench_latency (const char *name, codecvt_family family,
+	       const codecvt<InternT, ExternT, mbstate_t> &cvt)
+{
+  auto cps = make_code_points (family, opts.corpus_size);
+  if (cps.empty ())
+    {
+      printf ("# %s: the corpus is empty\n", name);
+      return;
+    }
+  auto strs = cut_short_strings (cvt, cps, family_intern_is_utf16 (family),
+				 4096);
+  auto n = strs.ext_begin.size () - 1;
+  if (strs.ext.empty ())
+    {
+      printf ("# %s: out() failed on the corpus\n", name);
+      return;
+    }
+  auto overhead = ~uint64_t (0);
+  for (int i = 0; i != 1000; ++i)
+    {
+      auto t0 = read_cycles ();
+      auto t1 = read_cycles ();
+      overhead = min (overhead, t1 - t0);
+    }
+  auto ns = 1e9 / cycles_per_second ();
+  auto intern_buf = basic_string<InternT> (strs.intern.size (), 0);
+  auto ext_buf = basic_string<ExternT> (strs.ext.size (), 0);
+
+  auto measure = [&] (const char *dir, auto &&call) {
+    auto hist = latency_histogram ();
+    auto ok = true;
+    // The first pass over the strings warms up the caches and the branch
+    // predictor and is not recorded.
+    for (size_t i = 0; i != opts.calls + n; ++i)
+      {
+	auto k = i % n;
+	auto t0 = read_cycles ();
+	ok &= call (k);
+	auto t1 = read_cycles ();
+	if (i >= n)
+	  hist.record (t1 - t0 - min (overhead, t1 - t0));
+      }
+    if (!ok)
+      printf ("# %s: %s() did not convert all strings\n", name, dir);
+    printf ("%-32s %-4s %10.1f %10.1f %10.1f %10.1f\n", name, dir,
+	    hist.percentile (50) * ns, hist.percentile (99) * ns,
+	    hist.percentile (99.9) * ns, hist.max () * ns);
+  };
+  measure ("in", [&] (size_t k) {
+    auto state = mbstate_t{};
+    const ExternT *from = strs.ext.data () + strs.ext_begin[k];
+    auto from_end = from + (strs.ext_begin[k + 1] - strs.ext_begin[k]);
+    auto to = intern_buf.data () + strs.intern_begin[k];
+    auto to_end = intern_buf.data () + strs.intern_begin[k + 1];
+    auto from_next = from;
+    auto to_next = to;
+    auto res
+      = cvt.in (state, from, from_end, from_next, to, to_end, to_next);
+    do_not_optimize (to_next);
+    return res == cvt.ok && to_next == to_end;
+  });
+  measure ("out", [&] (size_t k) {
+    auto state = mbstate_t{};
+    const InternT *from = strs.intern.data () + strs.intern_begin[k];
+    auto from_end = from + (strs.intern_begin[k + 1] - strs.intern_begin[k]);
+    auto to = ext_buf.data () + strs.ext_begin[k];
+    auto to_end = ext_buf.data () + strs.ext_begin[k + 1];
+    auto from_next = from;
+    auto to_next = to;
+    auto res
+      = cvt.out (state, from, from_end, from_next, to, to_end, to_next);
+    do_not_optimize (to_next);
+    return res == cvt.ok && to_next == to_end;
+  });
+}
+
+// Converts all strings of the latency mode one after another, with calls
+// through the virtual members of codecvt and through direct_codecvt, and
+// prints the mean time per call of both in nanoseconds. Only facets that
+// direct_codecvt can call directly are measured.
+template <class Facet>
+void
+bench_direct (const char *name, codecvt_family family, const Facet &cvt)
+{
+  if constexpr (direct_codecvt<Facet>::is_direct)
+    {
+      using InternT = typename Facet::intern_type;
+      using ExternT = typename Facet::extern_type;
+      const codecvt<InternT, ExternT, mbstate_t> &base = cvt;
+      auto direct = direct_codecvt<Facet> (cvt);
+      auto cps = make_code_points (family, opts.corpus_size);
+      if (cps.empty ())
+	{
+	  printf ("# %s: the corpus is empty\n", name);
+	  return;
+	}
+      auto strs = cut_short_strings (
+	base, cps, family_intern_is_utf16 (family), 4096);
+      auto n = strs.ext_begin.size () - 1;
+      const ExternT *ext = strs.ext.data ();
+      const InternT *intern = strs.intern.data ();
+      auto intern_buf = basic_string<InternT> (strs.intern.size (), 0);
+      auto ext_buf = basic_string<ExternT> (strs.ext.size (), 0);
+      auto bytes = strs.ext.size () * sizeof (ExternT);
+      // Every unit but the low half of a surrogate pair starts a code point.
+      auto cp_count = size_t (
+	count_if (strs.intern.begin (), strs.intern.end (),
+		  [] (InternT u) { return u < 0xDC00 || u > 0xDFFF; }));
+
+      // conv is the facet or the wrapper, both have the same members. With
+      // --counters, counts gets the counters of a pass over all strings.
+      auto time_in = [&] (const auto &conv, perf_counts &counts) {
+	return time_best ([&] {
+	  for (size_t k = 0; k != n; ++k)
+	    {
+	      auto state = mbstate_t{};
+	      auto from_next = ext + strs.ext_begin[k];
+	      auto to_next = intern_buf.data () + strs.intern_begin[k];
+	      conv.in (state, ext + strs.ext_begin[k],
+		       ext + strs.ext_begin[k + 1], from_next,
+		       intern_buf.data () + strs.intern_begin[k],
+		       intern_buf.data () + strs.intern_begin[k + 1], to_next);
+	      do_not_optimize (to_next);
+	    }
+	}, &counts);
+      };
+      auto time_out = [&] (const auto &conv, perf_counts &counts) {
+	return time_best ([&] {
+	  for (size_t k = 0; k != n; ++k)
+	    {
+	      auto state = mbstate_t{};
+	      auto from_next = intern + strs.intern_begin[k];
+	      auto to_next = ext_buf.data () + strs.ext_begin[k];
+	      conv.out (state, intern + strs.intern_begin[k],
+			intern + strs.intern_begin[k + 1], from_next,
+			ext_buf.data () + strs.ext_begin[k],
+			ext_buf.data () + strs.ext_begin[k + 1], to_next);
+	      do_not_optimize (to_next);
+	    }
+	}, &counts);
+      };
+      auto time_length = [&] (const auto &conv, perf_counts &counts) {
+	return time_best ([&] {
+	  for (size_t k = 0; k != n; ++k)
+	    {
+	      auto state = mbstate_t{};
+	      auto len = conv.length (state, ext + strs.ext_begin[k],
+				      ext + strs.ext_begin[k + 1], 64);
+	      do_not_optimize (len);
+	    }
+	}, &counts);
+      };
+      perf_counts c_virt, c_dir;
+      auto print = [&] (const char *what, double virt, double dir) {
+	printf ("%-32s %-6s %10.2f %10.2f %9.2fx\n", name, what,
+		virt / n * 1e9, dir / n * 1e9, virt / dir);
+	print_counts ((string (name) + " virtual").c_str (), what, c_virt,
+		      bytes, cp_count);
+	print_counts ((string (name) + " direct").c_str (), what, c_dir, bytes,
+		      cp_count);
+      };
+      print ("in", time_in (base, c_virt), time_in (direct, c_dir));
+      print ("out", time_out (base, c_virt), time_out (direct, c_dir));
+      print ("length", time_length (base, c_virt),
+	     time_length (direct, c_dir));
+    }
+}
+
+// Converts [from, from_end) to dest the way a filebuf does, with an input
+// window of in_chunk units and an output buffer of out_chunk units. After
+// every call that returns partial the conversion resumes from from_next,
+// carrying the state. The produced units are copied to dest. Both sizes must
+// be large enough to hold one complete character, otherwise the conversion
+// can not progress. Returns the number of calls, or 0 on error.
+template <class FromT, class ToT, class Conv>
+size_t
+convert_chunked (Conv &&conv, const FromT *from, const FromT *from_end,
+		 ToT *dest, ToT *out_buf, size_t in_chunk, size_t out_chunk)
+{
+  auto state = mbstate_t{};
+  auto calls = size_t (0);
+  while (from != from_end)
+    {
+      auto win_end = from + min<size_t> (from_end - from, in_chunk);
+      auto from_next = from;
+      auto to_next = out_buf;
+      auto res
+	= conv (state, from, win_end, from_next, out_buf, out_buf + out_chunk,
+		to_next);
+      ++calls;
+      dest = copy (out_buf, to_next, dest);
+      if (res == codecvt_base::error || res == codecvt_base::noconv)
+	return 0;
+      if (from_next == from && to_next == out_buf)
+	return 0;
+      from = from_next;
+    }
+  return calls;
+}
+
+// Smallest buffer size, in units, that can hold one character in any of the
+// encodings. Smaller requested sizes are rounded up to it.
+const size_t min_chunk_units = 4;
+
+// Sweeps the buffer sizes from 1 byte to opts.max_chunk bytes and prints a
+// table of throughput against buffer size that can be plotted directly, e.g.
+// with gnuplot, one data block per facet.
+template <class InternT, class ExternT>
+void
+bench_chunks (const char *name, codecvt_family family,
+	      const codecvt<InternT, ExternT, mbstate_t> &cvt)
+{
+  auto cps = make_code_points (family, opts.corpus_size);
+  auto intern = encode_intern<InternT> (cps, family_intern_is_utf16 (family));
+  auto ext = encode_extern (cvt, intern);
+  if (ext.empty ())
+    {
+      printf ("# %s: out() failed on the corpus\n", name);
+      return;
+    }
+  auto bytes = ext.size () * sizeof (ExternT);
+  auto intern_res = basic_string<InternT> (intern.size (), 0);
+  auto ext_res = basic_string<ExternT> (ext.size (), 0);
+  auto intern_buf = vector<InternT> ();
+  auto ext_buf = vector<ExternT> ();
+
+  auto do_in = [&] (auto &&... args) { return cvt.in (args...); };
+  auto do_out = [&] (auto &&... args) { return cvt.out (args...); };
+  auto units = [] (size_t chunk, size_t unit_size, bool swept) {
+    if (!swept)
+      return SIZE_MAX / 2;
+    return max (chunk / unit_size, min_chunk_units);
+  };
+  auto sweep_in = opts.series != sweep_out_buffer;
+  auto sweep_out = opts.series != sweep_in_buffer;
+
+  printf ("# %s\n", name);
+  printf ("# %10s %12s %12s %12s %12s\n", "chunk", "in MB/s", "in calls",
+	  "out MB/s", "out calls");
+  for (size_t chunk = 1; chunk <= opts.max_chunk; chunk *= 2)
+    {
+      // in(): extern is the input, intern is the output
+      auto in_units = units (chunk, sizeof (ExternT), sweep_in);
+      auto out_units = min (units (chunk, sizeof (InternT), sweep_out),
+			    intern.size () + min_chunk_units);
+      intern_buf.resize (out_units);
+      auto in_calls = size_t (0);
+      perf_counts in_counts, out_counts;
+      auto t_in = time_best ([&] {
+	in_calls = convert_chunked (do_in, ext.data (), ext.data () + ext.size (),
+				    intern_res.data (), intern_buf.data (),
+				    in_units, out_units);
+      }, &in_counts);
+      if (in_calls == 0 || intern_res != intern)
+	printf ("# %s: chunked in() failed at chunk %zu\n", name, chunk);
+
+      // out(): intern is the input, extern is the output
+      in_units = units (chunk, sizeof (InternT), sweep_in);
+      out_units = min (units (chunk, sizeof (ExternT), sweep_out),
+		       ext.size () + min_chunk_units);
+      ext_buf.resize (out_units);
+      auto out_calls = size_t (0);
+      auto t_out = time_best ([&] {
+	out_calls
+	  = convert_chunked (do_out, intern.data (),
+			     intern.data () + intern.size (), ext_res.data (),
+			     ext_buf.data (), in_units, out_units);
+      }, &out_counts);
+      if (out_calls == 0 || ext_res != ext)
+	printf ("# %s: chunked out() failed at chunk %zu\n", name, chunk);
+
+      printf ("  %10zu %12.1f %12zu %12.1f %12zu\n", chunk,
+	      bytes / t_in / 1e6, in_calls, bytes / t_out / 1e6, out_calls);
+      // As comments, so that the data block still plots.
+      auto label = "# chunk " + to_string (chunk);
+      print_counts (label.c_str (), "in", in_counts, bytes, cps.size ());
+      print_counts (label.c_str (), "out", out_counts, bytes, cps.size ());
+    }
+  printf ("\n\n");
+}
+
+// Compares the cost of sizing the corpus with length(), with the chunked
+// codecvt_length_bulk() and of decoding it with in().
+template <class InternT, class ExternT>
+void
+bench_length (const char *name, codecvt_family family,
+	      const codecvt<InternT, ExternT, mbstate_t> &cvt)
+{
+  auto cps = make_code_points (family, opts.corpus_size);
+  auto intern = encode_intern<InternT> (cps, family_intern_is_utf16 (family));
+  auto ext = encode_extern (cvt, intern);
+  if (ext.empty ())
+    {
+      printf ("%-32s out() failed on the corpus\n", name);
+      return;
+    }
+  auto bytes = ext.size () * sizeof (ExternT);
+  const ExternT *first = ext.data ();
+  const ExternT *last = ext.data () + ext.size ();
+
+  auto len = 0;
+  perf_counts c_len, c_bulk, c_in;
+  auto t_len = time_best ([&] {
+    auto state = mbstate_t{};
+    len = cvt.length (state, first, last, INT_MAX);
+  }, &c_len);
+  auto len_bulk = size_t (0);
+  auto t_bulk = time_best ([&] {
+    auto state = mbstate_t{};
+    len_bulk = codecvt_length_bulk (cvt, state, first, last, SIZE_MAX);
+  }, &c_bulk);
+  auto out_buf = basic_string<InternT> (intern.size (), 0);
+  auto t_in = time_best ([&] {
+    auto state = mbstate_t{};
+    auto in_next = first;
+    auto out_next = out_buf.data ();
+    cvt.in (state, first, last, in_next, out_buf.data (),
+	    out_buf.data () + out_buf.size (), out_next);
+    do_not_optimize (out_next);
+  }, &c_in);
+  if (size_t (len) != ext.size () || len_bulk != ext.size ())
+    printf ("%-32s length() did not count the whole corpus\n", name);
+  printf ("%-32s length %8.1f MB/s  bulk %8.1f MB/s  in %8.1f MB/s  "
+	  "in/length %5.2fx\n",
+	  name, bytes / t_len / 1e6, bytes / t_bulk / 1e6, bytes / t_in / 1e6,
+	  t_in / t_len);
+  print_counts (name, "length", c_len, bytes, cps.size ());
+  print_counts (name, "bulk", c_bulk, bytes, cps.size ());
+  print_counts (name, "in", c_in, bytes, cps.size ());
+}
+
+// Counters of one thread in run_on_threads, each on its own cache line so
+// that the benchmark does not cause false sharing itself.
+struct alignas (64) thread_result
+{
+  size_t runs = 0;
+  double seconds = 0;
+  bool ok = true;
+};
+
+// Runs n threads at once for opts.min_time seconds. Every thread calls
+// make_op () to set up its own data and then calls the returned function in
+// a loop. The function returns false if its result is wrong.
+template <class MakeOp>
+vector<thread_result>
+run_on_threads (unsigned n, MakeOp make_op)
+{
+  using clock = chrono::steady_clock;
+  auto results = vector<thread_result> (n);
+  auto ready = atomic<unsigned> (0);
+  auto go = atomic<bool> (false);
+  auto stop = atomic<bool> (false);
+  auto start = clock::time_point ();
+  auto work = [&] (thread_result &r) {
+    // Set up by the thread so that the data of different threads does not
+    // share cache lines or, on NUMA machines, nodes.
+    auto op = make_op ();
+    ++ready;
+    while (!go.load (memory_order_acquire))
+      this_thread::yield ();
+    do
+      {
+	r.ok = op () && r.ok;
+	++r.runs;
+      }
+    while (!stop.load (memory_order_relaxed));
+    r.seconds = chrono::duration<double> (clock::now () - start).count ();
+  };
+  auto threads = vector<thread> ();
+  for (unsigned i = 1; i < n; ++i)
+    threads.emplace_back (work, ref (results[i]));
+  while (ready != n - 1)
+    this_thread::yield ();
+  // The calling thread is the first worker, another thread stops it.
+  threads.emplace_back ([&] {
+    while (!go.load (memory_order_acquire))
+      this_thread::yield ();
+    this_thread::sleep_for (chrono::duration<double> (opts.min_time));
+    stop = true;
+  });
+  start = clock::now ();
+  go.store (true, memory_order_release);
+  work (results[0]);
+  for (auto &t : threads)
+    t.join ();
+  return results;
+}
+
+// Sum of the rates of the threads, in runs per second.
+double
+total_rate (const vector<thread_result> &results)
+{
+  auto total = 0.0;
+  for (auto &r : results)
+    total += r.runs / r.seconds;
+  return total;
+}
+
+// Converts the corpus with in() on 1 to opts.threads threads at once, all
+// through the same facet object, each thread with its own copy of the input,
+// its own output buffer and its own state. The efficiency is the total
+// throughput divided by the number of threads times the throughput of one
+// thread. As long as there are enough hardware threads it stays close to 1,
+// unless the facet takes a lock or writes to memory that is shared between
+// the threads. The spread is the throughput of the slowest thread divided by
+// that of the fastest one, a lock that is not fair shows up there.
+template <class InternT, class ExternT>
+void
+bench_threads (const char *name, codecvt_family family,
+	       const codecvt<InternT, ExternT, mbstate_t> &cvt)
+{
+  auto cps = make_code_points (family, opts.corpus_size);
+  auto intern = encode_intern<InternT> (cps, family_intern_is_utf16 (family));
+  auto ext = encode_extern (cvt, intern);
+  if (ext.empty ())
+    {
+      printf ("# %s: out() failed on the corpus\n", name);
+      return;
+    }
+  auto bytes = ext.size () * sizeof (ExternT);
+
+  printf ("# %s\n", name);
+  printf ("# %8s %12s %12s %12s %10s\n", "threads", "MB/s", "MB/s/thread",
+	  "efficiency", "spread");
+  auto single = 0.0;
+  for (unsigned n = 1; n <= opts.threads; ++n)
+    {
+      auto results = run_on_threads (n, [&] {
+	return [&cvt, in_buf = ext,
+		out_buf = basic_string<InternT> (intern.size (), 0)] () mutable {
+	  auto state = mbstate_t{};
+	  auto in_end = in_buf.data () + in_buf.size ();
+	  auto in_next = (const ExternT *) nullptr;
+	  auto out_next = (InternT *) nullptr;
+	  auto res = cvt.in (state, in_buf.data (), in_end, in_next,
+			     out_buf.data (), out_buf.data () + out_buf.size (),
+			     out_next);
+	  do_not_optimize (out_next);
+	  return res == cvt.ok && in_next == in_end
+		 && out_next == out_buf.data () + out_buf.size ();
+	};
+      });
+      auto total = total_rate (results) * bytes;
+      auto slowest = 1e300;
+      auto fastest = 0.0;
+      auto ok = true;
+      for (auto &r : results)
+	{
+	  auto rate = r.runs * bytes / r.seconds;
+	  slowest = min (slowest, rate);
+	  fastest = max (fastest, rate);
+	  ok = ok && r.ok;
+	}
+      if (!ok)
+	printf ("# %s: in() did not convert the corpus on %u threads\n", name,
+		n);
+      if (n == 1)
+	single = total;
+      printf ("  %8u %12.1f %12.1f %12.2f %10.2f\n", n, total / 1e6,
+	      total / n / 1e6, total / (n * single), slowest / fastest);
+    }
+  printf ("\n\n");
+}
+
+// Measures on 1 to opts.threads threads at once, in millions of operations
+// per second over all threads:
+// construct  std::locale (locale::classic (), new Facet) and its
+//            destruction, what code does that builds a locale per stream,
+// copy       copying a shared locale, an atomic increment and decrement of
+//            its reference count,
+// use_facet  use_facet on a shared locale,
+// registry   registered_facet<Facet> () from locale_registry.h.
+template <class Facet>
+void
+bench_locale (const char *name, codecvt_family, const Facet &)
+{
+  using base = codecvt<typename Facet::intern_type,
+		       typename Facet::extern_type, mbstate_t>;
+  auto &shared = registered_locale<Facet> ();
+  auto &shared_facet = registered_facet<Facet> ();
+  auto construct = [] {
+    return [] {
+      auto loc = locale (locale::classic (), new Facet);
+      return has_facet<base> (loc);
+    };
+  };
+  auto copy = [&] {
+    return [&] {
+      auto loc = shared;
+      do_not_optimize (loc);
+      return true;
+    };
+  };
+  auto lookup = [&] {
+    return [&] {
+      auto &f = use_facet<base> (shared);
+      do_not_optimize (f);
+      return &f == &shared_facet;
+    };
+  };
+  auto registry = [&] {
+    return [&] {
+      auto &f = registered_facet<Facet> ();
+      do_not_optimize (f);
+      return &f == &shared_facet;
+    };
+  };
+
+  printf ("# %s\n", name);
+  printf ("# %8s %12s %12s %12s %12s\n", "threads", "construct", "copy",
+	  "use_facet", "registry");
+  for (unsigned n = 1; n <= opts.threads; ++n)
+    {
+      auto ok = true;
+      auto rate = [&] (auto make_op) {
+	auto results = run_on_threads (n, make_op);
+	for (auto &r : results)
+	  ok = ok && r.ok;
+	return total_rate (results) / 1e6;
+      };
+      auto r_construct = rate (construct);
+      auto r_copy = rate (copy);
+      auto r_lookup = rate (lookup);
+      auto r_registry = rate (registry);
+      if (!ok)
+	printf ("# %s: wrong facet on %u threads\n", name, n);
+      printf ("  %8u %12.2f %12.2f %12.2f %12.2f\n", n, r_construct, r_copy,
+	      r_lookup, r_registry);
+    }
+  printf ("\n\n");
+}
+
+void
+usage (const char *argv0)
+{
+  printf ("Usage: %s [mode] [options]\n"
+	  "Modes:\n"
+	  "  throughput     convert the corpus in one call (default)\n"
+	  "  chunks         sweep buffer sizes, resuming after partial\n"
+	  "  length         compare length() to a full in()\n"
+	  "  threads        in() on 1 to N threads through one shared facet\n"
+	  "  locale         locale construction and facet lookup on 1 to N\n"
+	  "                 threads\n"
+	  "  classes        cost per code point of each UTF-8 length class\n"
+	  "                 alone and mixed\n"
+	  "  latency        percentiles of the time of single calls on\n"
+	  "                 strings of 4 to 64 bytes\n"
+	  "  direct         calls on short strings through the virtual\n"
+	  "                 members and through direct_codecvt\n"
+	  "Options:\n"
+	  "  --size=MIB     size of the UTF-8 corpus in MiB (default 8)\n"
+	  "  --time=SEC     minimal time per measurement (default 0.2)\n"
+	  "  --filter=STR   only facets whose name contains STR\n"
+	  "  --max-chunk=N  largest buffer size in bytes (default 1048576)\n"
+	  "  --sweep=WHICH  buffers to sweep: in, out or both (default both)\n"
+	  "  --threads=N    most threads in the threads and locale modes\n"
+	  "                 (default %u)\n"
+	  "  --corpus=NAME  generate the corpus with a preset of\n"
+	  "                 corpus_generator.h instead of repeating the test\n"
+	  "                 code points: tests, ascii-logs, cyrillic, cjk,\n"
+	  "                 emoji-chat or adversarial\n"
+	  "  --ratios=A,B,C,D  weights of the 1- to 4-byte classes in the\n"
+	  "                 generated corpus\n"
+	  "  --seed=N       seed of the generated corpus (default 1)\n"
+	  "  --counters     read hardware performance counters around every\n"
+	  "                 measured run, in the throughput, chunks, length,\n"
+	  "                 classes and direct modes, on Linux. Not in the\n"
+	  "                 latency mode, where reading them per call would\n"
+	  "                 cost more than the calls, nor in the threads\n"
+	  "                 mode, where the calls run on other threads\n"
+	  "  --calls=N      timed calls per direction in the latency mode\n"
+	  "                 (default 1000000)\n"
+	  "Buffers smaller than %zu units are rounded up to %zu units.\n"
+	  "Set UTF_KERNELS to scalar, sse4.2, avx2 or avx512 to force the\n"
+	  "instruction set of the accelerated facets. avx512 only widens the\n"
+	  "UTF-8 kernels, the UTF-16 byte order ones stay at avx2.\n",
+	  argv0, opts.threads, min_chunk_units, min_chunk_units);
+}
+
+enum bench_mode
+{
+  mode_throughput,
+  mode_chunks,
+  mode_length,
+  mode_threads,
+  mode_locale,
+  mode_classes,
+  mode_latency,
+  mode_direct
+};
+
+bool
+parse_options (int argc, char *argv[], bench_mode &mode)
+{
+  auto ratios = (const char *) nullptr;
+  for (int i = 1; i < argc; ++i)
+    {
+      auto a = argv[i];
+      if (strcmp (a, "throughput") == 0)
+	mode = mode_throughput;
+      else if (strcmp (a, "chunks") == 0)
+	mode = mode_chunks;
+      else if (strcmp (a, "length") == 0)
+	mode = mode_length;
+      else if (strcmp (a, "threads") == 0)
+	mode = mode_threads;
+      else if (strcmp (a, "locale") == 0)
+	mode = mode_locale;
+      else if (strcmp (a, "classes") == 0)
+	mode = mode_classes;
+      else if (strcmp (a, "latency") == 0)
+	mode = mode_latency;
+      else if (strcmp (a, "direct") == 0)
+	mode = mode_direct;
+      else if (strncmp (a, "--size=", 7) == 0)
+	opts.corpus_size = strtoul (a + 7, nullptr, 10) << 20;
+      else if (strncmp (a, "--time=", 7) == 0)
+	opts.min_time = strtod (a + 7, nullptr);
+      else if (strncmp (a, "--filter=", 9) == 0)
+	opts.filter = a + 9;
+      else if (strncmp (a, "--max-chunk=", 12) == 0)
+	opts.max_chunk = strtoul (a + 12, nullptr, 10);
+      else if (strcmp (a, "--sweep=in") == 0)
+	opts.series = sweep_in_buffer;
+      else if (strcmp (a, "--sweep=out") == 0)
+	opts.series = sweep_out_buffer;
+      else if (strcmp (a, "--sweep=both") == 0)
+	opts.series = sweep_both_buffers;
+      else if (strncmp (a, "--corpus=", 9) == 0)
+	{
+	  auto p = find_corpus_preset (a + 9);
+	  if (!p)
+	    return false;
+	  opts.preset = *p;
+	  opts.generated = true;
+	}
+      else if (strncmp (a, "--ratios=", 9) == 0)
+	ratios = a + 9;
+      else if (strncmp (a, "--seed=", 7) == 0)
+	opts.seed = strtoull (a + 7, nullptr, 10);
+      else if (strncmp (a, "--calls=", 8) == 0)
+	opts.calls = strtoull (a + 8, nullptr, 10);
+      else if (strcmp (a, "--counters") == 0)
+	opts.counters = true;
+      else if (strncmp (a, "--threads=", 10) == 0)
+	opts.threads = max (strtoul (a + 10, nullptr, 10), 1ul);
+      else
+	return false;
+    }
+  // The ratios apply to any preset, given before or after them.
+  if (ratios)
+    {
+      if (!parse_corpus_ratios (ratios, opts.preset))
+	return false;
+      opts.generated = true;
+    }
+  return true;
+}
+
+int
+main (int argc, char *argv[])
+{
+  auto mode = mode_throughput;
+  if (!parse_options (argc, argv, mode))
+    {
+      usage (argv[0]);
+      return 2;
+    }
+  printf ("# Corpus: %zu MiB of UTF-8", opts.corpus_size >> 20);
+  if (opts.generated)
+    {
+      auto &c = opts.preset.classes;
+      printf (", preset %s, ratios %g,%g,%g,%g, seed %llu", opts.preset.name,
+	      c[0].weight, c[1].weight, c[2].weight, c[3].weight,
+	      (unsigned long long) opts.seed);
+    }
+  printf ("\n");
+  printf ("# Kernels: %s\n",
+	  utf_kernel_level_name (utf_kernel_current_level ()));
+  if (opts.counters)
+    printf ("# Counters: %s\n", bench_counters ().available ()
+				     ? "per call, user space only"
+				     : "not available");
+  if (mode == mode_latency)
+    printf ("# %-30s %-4s %10s %10s %10s %10s\n", "latency in ns", "",
+	    "p50", "p99", "p99.9", "max");
+  if (mode == mode_direct)
+    printf ("# %-30s %-6s %10s %10s %10s\n", "ns per call", "", "virtual",
+	    "direct", "speedup");
+  if (mode == mode_threads || mode == mode_locale)
+    printf ("# Hardware threads: %u\n", thread::hardware_concurrency ());
+  for_each_codecvt ([mode] (const char *name, codecvt_family family,
+			    const auto &cvt) {
+    if (!facet_selected (name))
+      return;
+    switch (mode)
+      {
+      case mode_throughput:
+	bench_throughput (name, family, cvt);
+	break;
+      case mode_chunks:
+	bench_chunks (name, family, cvt);
+	break;
+      case mode_length:
+	bench_length (name, family, cvt);
+	break;
+      case mode_threads:
+	bench_threads (name, family, cvt);
+	break;
+      case mode_locale:
+	bench_locale (name, family, cvt);
+	break;
+      case mode_classes:
+	bench_classes (name, family, cvt);
+	break;
+      case mode_latency:
+	bench_latency (name, family, cvt);
+	break;
+      case mode_direct:
+	bench_direct (name, family, cvt);
+	break;
+      }
+  });
+}
@@ -0,0 +1,100 @@
+// Copyright 2020-2023 Dimitrij Mijoski
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Writes a corpus of corpus_generator.h in every external encoding of the
+// facets: PREFIX.utf8, for the char and the char8_t facets, PREFIX.utf16be
+// and PREFIX.utf16le. The same preset, size and seed give the same files on
+// every platform, so they can be shared between machines and compared with
+// other libraries.
+
+#include "corpus_generator.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+using namespace std;
+
+namespace {
+
+void
+usage (const char *argv0)
+{
+  printf ("Usage: %s PRESET [options]\n"
+	  "Presets:\n",
+	  argv0);
+  for (auto &p : corpus_presets)
+    printf ("  %s\n", p.name);
+  printf ("Options:\n"
+	  "  --size=MIB        size of the UTF-8 file in MiB (default 8)\n"
+	  "  --seed=N          seed of the generator (default 1)\n"
+	  "  --ratios=A,B,C,D  weights of the 1- to 4-byte classes\n"
+	  "  --out=PREFIX      prefix of the files (default the preset)\n");
+}
+
+bool
+write_file (const string &path, const string &data)
+{
+  auto file = ofstream (path, ios::binary);
+  file.write (data.data (), data.size ());
+  if (!file)
+    {
+      printf ("Can not write %s\n", path.c_str ());
+      return false;
+    }
+  printf ("%s: %zu bytes\n", path.c_str (), data.size ());
+  return true;
+}
+
+} // namespace
+
+int
+main (int argc, char *argv[])
+{
+  auto p = argc > 1 ? find_corpus_preset (argv[1]) : nullptr;
+  if (!p)
+    {
+      usage (argv[0]);
+      return 2;
+    }
+  auto preset = *p;
+  size_t size = 8 << 20;
+  uint64_t seed = 1;
+  auto prefix = string (preset.name);
+  for (int i = 2; i < argc; ++i)
+    {
+      auto a = argv[i];
+      if (strncmp (a, "--size=", 7) == 0)
+	size = strtoul (a + 7, nullptr, 10) << 20;
+      else if (strncmp (a, "--seed=", 7) == 0)
+	seed = strtoull (a + 7, nullptr, 10);
+      else if (strncmp (a, "--ratios=", 9) == 0)
+	{
+	  if (!parse_corpus_ratios (a + 9, preset))
+	    {
+	      usage (argv[0]);
+	      return 2;
+	    }
+	}
+      else if (strncmp (a, "--out=", 6) == 0)
+	prefix = a + 6;
+      else
+	{
+	  usage (argv[0]);
+	  return 2;
+	}
+    }
+
+  auto cps = generate_corpus (preset, size, seed);
+  size_t counts[4] = {};
+  for (auto c : cps)
+    ++counts[utf8_length (c) - 1];
+  printf ("%zu code points, by length in UTF-8: %zu %zu %zu %zu\n",
+	  cps.size (), counts[0], counts[1], counts[2], counts[3]);
+  if (!write_file (prefix + ".utf8", encode_utf8 (cps))
+      || !write_file (prefix + ".utf16be", encode_utf16_bytes (cps, false))
+      || !write_file (prefix + ".utf16le", encode_utf16_bytes (cps, true)))
+    return 1;
+}
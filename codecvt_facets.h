@@ -0,0 +1,183 @@
+// Copyright 2020-2023 Dimitrij Mijoski
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef CODECVT_FACETS_H
+#define CODECVT_FACETS_H
+
+#include <codecvt>
+#include <locale>
+
+#include "dfa_codecvt.h"
+#include "simd_codecvt.h"
+
+// The families of conversions that the test suite covers. The family
+// determines what the internal and external sequences look like.
+enum codecvt_family
+{
+  family_utf8_utf32,
+  family_utf8_utf16,
+  family_utf8_ucs2,
+  family_utf16_utf32,
+  family_utf16_ucs2
+};
+
+// Internal sequence is made of UTF-16 code units, even if InternT is 32-bit.
+inline bool
+family_intern_is_utf16 (codecvt_family f)
+{
+  return f == family_utf8_utf16;
+}
+
+// Only code points from the BMP can be converted.
+inline bool
+family_is_bmp_only (codecvt_family f)
+{
+  return f == family_utf8_ucs2 || f == family_utf16_ucs2;
+}
+
+inline const char *
+family_name (codecvt_family f)
+{
+  switch (f)
+    {
+    case family_utf8_utf32:
+      return "utf8_utf32";
+    case family_utf8_utf16:
+      return "utf8_utf16";
+    case family_utf8_ucs2:
+      return "utf8_ucs2";
+    case family_utf16_utf32:
+      return "utf16_utf32";
+    case family_utf16_ucs2:
+      return "utf16_ucs2";
+    }
+  return "";
+}
+
+// Calls f (name, family, cvt) for every facet that is tested by the tasks
+// of the add_*_tasks functions of codecvt.cpp, in the same order, under the
+// same names and under the same preprocessor conditions. Keep the two lists
+// in sync.
+template <class Func>
+void
+for_each_codecvt (Func &&f)
+{
+  using namespace std;
+  auto loc_c = locale::classic ();
+
+  // add_utf8_utf32_tasks
+  {
+    using codecvt_c32 = codecvt<char32_t, char, mbstate_t>;
+    f ("codecvt<char32_t, char>", family_utf8_utf32,
+       use_facet<codecvt_c32> (loc_c));
+
+    codecvt_utf8<char32_t> cvt2;
+    f ("codecvt_utf8<char32_t>", family_utf8_utf32, cvt2);
+
+#if __SIZEOF_WCHAR_T__ == 4
+    codecvt_utf8<wchar_t> cvt3;
+    f ("codecvt_utf8<wchar_t>", family_utf8_utf32, cvt3);
+#endif
+
+#ifdef __cpp_char8_t
+    using codecvt_c32_c8 = codecvt<char32_t, char8_t, mbstate_t>;
+    f ("codecvt<char32_t, char8_t>", family_utf8_utf32,
+       use_facet<codecvt_c32_c8> (loc_c));
+#endif
+
+    simd_codecvt_c32 cvt5;
+    f ("simd_codecvt_c32", family_utf8_utf32, cvt5);
+
+    dfa_codecvt_c32 cvt6;
+    f ("dfa_codecvt_c32", family_utf8_utf32, cvt6);
+  }
+
+  // add_utf8_utf16_tasks
+  {
+    using codecvt_c16 = codecvt<char16_t, char, mbstate_t>;
+    f ("codecvt<char16_t, char>", family_utf8_utf16,
+       use_facet<codecvt_c16> (loc_c));
+
+    codecvt_utf8_utf16<char16_t> cvt2;
+    f ("codecvt_utf8_utf16<char16_t>", family_utf8_utf16, cvt2);
+
+    codecvt_utf8_utf16<char32_t> cvt3;
+    f ("codecvt_utf8_utf16<char32_t>", family_utf8_utf16, cvt3);
+
+#if _WIN32 || __SIZEOF_WCHAR_T__ >= 2
+    codecvt_utf8_utf16<wchar_t> cvt4;
+    f ("codecvt_utf8_utf16<wchar_t>", family_utf8_utf16, cvt4);
+#endif
+
+#ifdef __cpp_char8_t
+    using codecvt_c16_c8 = codecvt<char16_t, char8_t, mbstate_t>;
+    f ("codecvt<char16_t, char8_t>", family_utf8_utf16,
+       use_facet<codecvt_c16_c8> (loc_c));
+#endif
+
+    simd_codecvt_c16 cvt6;
+    f ("simd_codecvt_c16", family_utf8_utf16, cvt6);
+
+    dfa_codecvt_c16 cvt7;
+    f ("dfa_codecvt_c16", family_utf8_utf16, cvt7);
+  }
+
+  // add_utf8_ucs2_tasks
+  {
+    codecvt_utf8<char16_t> cvt;
+    f ("codecvt_utf8<char16_t>", family_utf8_ucs2, cvt);
+
+#if _WIN32 || __SIZEOF_WCHAR_T__ == 2
+    codecvt_utf8<wchar_t> cvt2;
+    f ("codecvt_utf8<wchar_t>", family_utf8_ucs2, cvt2);
+#endif
+  }
+
+  // add_utf16_utf32_tasks
+  {
+    codecvt_utf16<char32_t> cvt;
+    f ("codecvt_utf16<char32_t> BE", family_utf16_utf32, cvt);
+
+    codecvt_utf16<char32_t, 0x10FFFF, codecvt_mode::little_endian> cvt2;
+    f ("codecvt_utf16<char32_t> LE", family_utf16_utf32, cvt2);
+
+#if __SIZEOF_WCHAR_T__ == 4
+    codecvt_utf16<wchar_t> cvt3;
+    f ("codecvt_utf16<wchar_t> BE", family_utf16_utf32, cvt3);
+
+    codecvt_utf16<wchar_t, 0x10FFFF, codecvt_mode::little_endian> cvt4;
+    f ("codecvt_utf16<wchar_t> LE", family_utf16_utf32, cvt4);
+#endif
+
+    simd_codecvt_utf16<char32_t> cvt5;
+    f ("simd_codecvt_utf16<char32_t> BE", family_utf16_utf32, cvt5);
+
+    simd_codecvt_utf16<char32_t, codecvt_mode::little_endian> cvt6;
+    f ("simd_codecvt_utf16<char32_t> LE", family_utf16_utf32, cvt6);
+  }
+
+  // add_utf16_ucs2_tasks
+  {
+    codecvt_utf16<char16_t> cvt;
+    f ("codecvt_utf16<char16_t> BE", family_utf16_ucs2, cvt);
+
+    codecvt_utf16<char16_t, 0x10FFFF, codecvt_mode::little_endian> cvt2;
+    f ("codecvt_utf16<char16_t> LE", family_utf16_ucs2, cvt2);
+
+#if __SIZEOF_WCHAR_T__ == 2
+    codecvt_utf16<wchar_t> cvt3;
+    f ("codecvt_utf16<wchar_t> BE", family_utf16_ucs2, cvt3);
+
+    codecvt_utf16<wchar_t, 0x10FFFF, codecvt_mode::little_endian> cvt4;
+    f ("codecvt_utf16<wchar_t> LE", family_utf16_ucs2, cvt4);
+#endif
+
+    simd_codecvt_utf16<char16_t> cvt5;
+    f ("simd_codecvt_utf16<char16_t> BE", family_utf16_ucs2, cvt5);
+
+    simd_codecvt_utf16<char16_t, codecvt_mode::little_endian> cvt6;
+    f ("simd_codecvt_utf16<char16_t> LE", family_utf16_ucs2, cvt6);
+  }
+}
+
+#endif // CODECVT_FACETS_H
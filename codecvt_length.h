@@ -0,0 +1,70 @@
+// Copyright 2020-2023 Dimitrij Mijoski
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef CODECVT_LENGTH_H
+#define CODECVT_LENGTH_H
+
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <locale>
+
+// Like cvt.length (state, from, from_end, max), but without the int limits
+// on the input size, the maximal number of internal characters and the
+// return value, so it can size inputs larger than 2 GiB in one call.
+//
+// Returns the number of external characters from the start of [from,
+// from_end) that form complete characters and would be converted by in()
+// into at most max internal characters. The input is fed to length() in
+// chunks of at most chunk external characters. A character that is split
+// by the end of a chunk is simply given to the next chunk.
+//
+// length() does not tell how many internal characters it counted, so while
+// max can not be reached in the rest of the input (every facet produces at
+// most one internal character per external one) the count is not needed.
+// Otherwise, the rest is converted with in() to keep count of max exactly.
+template <class InternT, class ExternT>
+size_t
+codecvt_length_bulk (const std::codecvt<InternT, ExternT, mbstate_t> &cvt,
+		     mbstate_t &state, const ExternT *from,
+		     const ExternT *from_end, size_t max,
+		     size_t chunk = size_t (1) << 30)
+{
+  using namespace std;
+  const auto start = from;
+  chunk = std::max<size_t> ({chunk, size_t (cvt.max_length ()), 4});
+  chunk = min<size_t> (chunk, INT_MAX);
+
+  while (from != from_end && max >= size_t (from_end - from))
+    {
+      auto chunk_end = from + min<size_t> (from_end - from, chunk);
+      auto len = cvt.length (state, from, chunk_end, INT_MAX);
+      if (len <= 0)
+	return from - start;
+      from += len;
+      // Stopped before the end of the chunk on something else than a
+      // character split by the chunk boundary.
+      if (chunk_end == from_end
+	  || chunk_end - from >= std::max (cvt.max_length (), 4))
+	return from - start;
+    }
+
+  const size_t buf_size = 4096;
+  InternT buf[buf_size];
+  while (from != from_end && max != 0)
+    {
+      auto from_next = from;
+      auto to_next = buf;
+      auto res = cvt.in (state, from, from_end, from_next, buf,
+			 buf + min (max, buf_size), to_next);
+      max -= to_next - buf;
+      if (from_next == from)
+	break;
+      from = from_next;
+      if (res != codecvt_base::partial)
+	break;
+    }
+  return from - start;
+}
+
+#endif // CODECVT_LENGTH_H
@@ -0,0 +1,223 @@
+// Copyright 2020-2023 Dimitrij Mijoski
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef CORPUS_GENERATOR_H
+#define CORPUS_GENERATOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+// Generator of text corpora for the benchmarks. The code points fall in the
+// same four classes as in the tests, by their length in UTF-8: 1 byte like
+// 'b', 2 bytes like U+0448, 3 bytes like U+AAAA and 4 bytes like U+10AAAA.
+// A preset gives every class a range of code points and a weight, and the
+// mean length of the runs of one class, since real text switches classes
+// at word boundaries and not at every character.
+//
+// The output depends only on the preset, the size and the seed, on every
+// platform. The random numbers and their mapping to ranges are defined here,
+// not by the standard distributions, which differ between libraries.
+
+struct corpus_class
+{
+  char32_t first, last; // range of the code points, surrogates are skipped
+  double weight;
+};
+
+struct corpus_preset
+{
+  const char *name;
+  corpus_class classes[4]; // by length in UTF-8
+  double mean_run;	   // mean number of code points in a run of a class
+};
+
+const corpus_preset corpus_presets[] = {
+  // Every class with the code point of the tests, switching every time.
+  {"tests",
+   {{U'b', U'b', 1}, {0x0448, 0x0448, 1}, {0xAAAA, 0xAAAA, 1},
+    {0x10AAAA, 0x10AAAA, 1}},
+   1},
+  // Log lines, printable ASCII with some Latin-1, punctuation and emoji.
+  {"ascii-logs",
+   {{0x20, 0x7E, 0.98}, {0xA0, 0xFF, 0.015}, {0x2010, 0x206F, 0.004},
+    {0x1F300, 0x1F64F, 0.001}},
+   20},
+  // Russian text, words of Cyrillic letters between spaces and punctuation.
+  {"cyrillic",
+   {{0x20, 0x7E, 0.25}, {0x0410, 0x044F, 0.74}, {0x2010, 0x2027, 0.009},
+    {0x1F300, 0x1F64F, 0.001}},
+   6},
+  // Chinese or Japanese text, CJK ideographs with some ASCII and a few
+  // ideographs from the supplementary planes.
+  {"cjk",
+   {{0x20, 0x7E, 0.1}, {0xA0, 0xFF, 0.005}, {0x4E00, 0x9FFF, 0.89},
+    {0x20000, 0x2A6DF, 0.005}},
+   8},
+  // Chat messages with a lot of emoji and symbols.
+  {"emoji-chat",
+   {{0x20, 0x7E, 0.6}, {0xA0, 0xFF, 0.02}, {0x2600, 0x27BF, 0.08},
+    {0x1F300, 0x1F64F, 0.3}},
+   3},
+  // All code points of every class, equally likely, switching every time.
+  // Worst case for branch prediction.
+  {"adversarial",
+   {{0x0, 0x7F, 1}, {0x80, 0x7FF, 1}, {0x800, 0xFFFF, 1},
+    {0x10000, 0x10FFFF, 1}},
+   1},
+};
+
+// The preset with the given name, or nullptr.
+inline const corpus_preset *
+find_corpus_preset (const char *name)
+{
+  for (auto &p : corpus_presets)
+    if (strcmp (p.name, name) == 0)
+      return &p;
+  return nullptr;
+}
+
+// Sets the weights of the classes of preset from a string like
+// "0.9,0.05,0.05,0". Returns false if it does not hold four numbers.
+inline bool
+parse_corpus_ratios (const char *s, corpus_preset &preset)
+{
+  for (int i = 0; i < 4; ++i)
+    {
+      char *end;
+      preset.classes[i].weight = strtod (s, &end);
+      if (end == s || preset.classes[i].weight < 0
+	  || *end != (i == 3 ? '\0' : ','))
+	return false;
+      s = end + 1;
+    }
+  return true;
+}
+
+// splitmix64, small and with a fixed output on every platform.
+class corpus_random
+{
+public:
+  explicit corpus_random (uint64_t seed) : state (seed) {}
+
+  uint64_t
+  next ()
+  {
+    auto z = (state += 0x9E3779B97F4A7C15);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+    return z ^ (z >> 31);
+  }
+
+  // Uniform in [0, 1).
+  double
+  uniform ()
+  {
+    return (next () >> 11) * 0x1p-53;
+  }
+
+private:
+  uint64_t state;
+};
+
+inline size_t
+utf8_length (char32_t c)
+{
+  return c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+}
+
+// Generates code points with the preset until they take at least
+// utf8_bytes bytes in UTF-8. If bmp_only, the class of 4 bytes is left out,
+// for the UCS-2 facets.
+inline std::u32string
+generate_corpus (const corpus_preset &preset, size_t utf8_bytes,
+		 uint64_t seed, bool bmp_only = false)
+{
+  auto rng = corpus_random (seed);
+  auto classes = bmp_only ? 3 : 4;
+  auto total = 0.0;
+  for (int i = 0; i < classes; ++i)
+    total += preset.classes[i].weight;
+  auto ret = std::u32string ();
+  ret.reserve (utf8_bytes / 2);
+  size_t bytes = 0;
+  auto cls = &preset.classes[0];
+  while (bytes < utf8_bytes && total > 0)
+    {
+      // A new run starts with probability 1 / mean_run.
+      if (ret.empty () || rng.uniform () * preset.mean_run < 1)
+	{
+	  auto w = rng.uniform () * total;
+	  auto i = 0;
+	  while (i + 1 < classes && w >= preset.classes[i].weight)
+	    w -= preset.classes[i++].weight;
+	  cls = &preset.classes[i];
+	}
+      if (cls->weight <= 0)
+	continue;
+      char32_t c;
+      do
+	c = cls->first + rng.next () % (cls->last - cls->first + 1);
+      while (c >= 0xD800 && c <= 0xDFFF);
+      ret += c;
+      bytes += utf8_length (c);
+    }
+  return ret;
+}
+
+// Encodes code points, which must not be surrogates, to UTF-8.
+inline std::string
+encode_utf8 (const std::u32string &cps)
+{
+  auto ret = std::string ();
+  ret.reserve (cps.size () * 2);
+  for (auto c : cps)
+    if (c < 0x80)
+      ret += char (c);
+    else if (c < 0x800)
+      {
+	ret += char (0xC0 | c >> 6);
+	ret += char (0x80 | (c & 0x3F));
+      }
+    else if (c < 0x10000)
+      {
+	ret += char (0xE0 | c >> 12);
+	ret += char (0x80 | (c >> 6 & 0x3F));
+	ret += char (0x80 | (c & 0x3F));
+      }
+    else
+      {
+	ret += char (0xF0 | c >> 18);
+	ret += char (0x80 | (c >> 12 & 0x3F));
+	ret += char (0x80 | (c >> 6 & 0x3F));
+	ret += char (0x80 | (c & 0x3F));
+      }
+  return ret;
+}
+
+// Encodes code points to UTF-16 bytes in the given byte order, like
+// codecvt_utf16 converts them.
+inline std::string
+encode_utf16_bytes (const std::u32string &cps, bool little_endian)
+{
+  auto ret = std::string ();
+  ret.reserve (cps.size () * 2);
+  auto put = [&] (char32_t u) {
+    auto hi = char (u >> 8), lo = char (u & 0xFF);
+    ret += little_endian ? lo : hi;
+    ret += little_endian ? hi : lo;
+  };
+  for (auto c : cps)
+    if (c < 0x10000)
+      put (c);
+    else
+      {
+	put (0xD7C0 + (c >> 10));
+	put (0xDC00 + (c & 0x3FF));
+      }
+  return ret;
+}
+
+#endif // CORPUS_GENERATOR_H
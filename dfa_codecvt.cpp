@@ -0,0 +1,84 @@
+// Copyright 2020-2023 Dimitrij Mijoski
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "dfa_codecvt.h"
+#include "utf_kernels.h"
+
+#include <algorithm>
+
+using namespace std;
+
+template <class InternT>
+codecvt_base::result
+dfa_codecvt_utf8<InternT>::do_out (state_type &, const intern_type *from,
+				   const intern_type *from_end,
+				   const intern_type *&from_next,
+				   extern_type *to, extern_type *to_end,
+				   extern_type *&to_next) const
+{
+  return convert_out (from, from_end, from_next, to, to_end, to_next);
+}
+
+template <class InternT>
+codecvt_base::result
+dfa_codecvt_utf8<InternT>::do_unshift (state_type &, extern_type *to,
+				       extern_type *,
+				       extern_type *&to_next) const
+{
+  to_next = to;
+  return codecvt_base::noconv;
+}
+
+template <class InternT>
+codecvt_base::result
+dfa_codecvt_utf8<InternT>::do_in (state_type &, const extern_type *from,
+				  const extern_type *from_end,
+				  const extern_type *&from_next,
+				  intern_type *to, intern_type *to_end,
+				  intern_type *&to_next) const
+{
+  return convert_in (from, from_end, from_next, to, to_end, to_next);
+}
+
+template <class InternT>
+int
+dfa_codecvt_utf8<InternT>::do_encoding () const throw ()
+{
+  return 0;
+}
+
+template <class InternT>
+bool
+dfa_codecvt_utf8<InternT>::do_always_noconv () const throw ()
+{
+  return false;
+}
+
+template <class InternT>
+int
+dfa_codecvt_utf8<InternT>::do_length (state_type &, const extern_type *from,
+				      const extern_type *end, size_t max) const
+{
+  return convert_length (from, end, max);
+}
+
+template <class InternT>
+int
+dfa_codecvt_utf8<InternT>::convert_length (const extern_type *from,
+					   const extern_type *end, size_t max)
+{
+  return length_by_kernel<InternT> (
+    utf8_dfa_kernels<InternT>::in,
+    reinterpret_cast<const unsigned char *> (from),
+    reinterpret_cast<const unsigned char *> (end), max);
+}
+
+template <class InternT>
+int
+dfa_codecvt_utf8<InternT>::do_max_length () const throw ()
+{
+  return 4;
+}
+
+template class dfa_codecvt_utf8<char32_t>;
+template class dfa_codecvt_utf8<char16_t>;
@@ -0,0 +1,93 @@
+// Copyright 2020-2023 Dimitrij Mijoski
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef DIRECT_CODECVT_H
+#define DIRECT_CODECVT_H
+
+#include <locale>
+#include <type_traits>
+
+// True if Facet is final and has the static convert_in, convert_out and
+// convert_length of the facets in simd_codecvt.h and dfa_codecvt.h.
+template <class Facet, class = void>
+struct has_direct_conversions : std::false_type
+{
+};
+
+template <class Facet>
+struct has_direct_conversions<
+  Facet, std::void_t<decltype (&Facet::convert_in),
+		     decltype (&Facet::convert_out),
+		     decltype (&Facet::convert_length)>>
+  : std::bool_constant<std::is_final_v<Facet>>
+{
+};
+
+// Has in (), out () and length () with the signatures of the codecvt
+// members. If the type of the facet has direct conversions, they are called
+// instead of the virtual do_in (), do_out () and do_length (), and the
+// compiler can inline them into the caller. Since the type is final, the
+// object can not be of a derived type that overrides the virtual functions,
+// so the results are the same. Other facets, e.g. the standard ones, are
+// called through the virtual functions as usual.
+//
+// For long strings the virtual call does not matter. For strings of a few
+// characters it is a large part of the time of a conversion.
+template <class Facet>
+class direct_codecvt
+{
+public:
+  using result = std::codecvt_base::result;
+  using intern_type = typename Facet::intern_type;
+  using extern_type = typename Facet::extern_type;
+  using state_type = typename Facet::state_type;
+
+  static constexpr bool is_direct = has_direct_conversions<Facet>::value;
+
+  explicit direct_codecvt (const Facet &cvt) : cvt (cvt) {}
+
+  result
+  out (state_type &state, const intern_type *from,
+       const intern_type *from_end, const intern_type *&from_next,
+       extern_type *to, extern_type *to_end, extern_type *&to_next) const
+  {
+    if constexpr (is_direct)
+      return Facet::convert_out (from, from_end, from_next, to, to_end,
+				 to_next);
+    else
+      return cvt.out (state, from, from_end, from_next, to, to_end, to_next);
+  }
+
+  result
+  in (state_type &state, const extern_type *from, const extern_type *from_end,
+      const extern_type *&from_next, intern_type *to, intern_type *to_end,
+      intern_type *&to_next) const
+  {
+    if constexpr (is_direct)
+      return Facet::convert_in (from, from_end, from_next, to, to_end,
+				to_next);
+    else
+      return cvt.in (state, from, from_end, from_next, to, to_end, to_next);
+  }
+
+  int
+  length (state_type &state, const extern_type *from,
+	  const extern_type *from_end, size_t max) const
+  {
+    if constexpr (is_direct)
+      return Facet::convert_length (from, from_end, max);
+    else
+      return cvt.length (state, from, from_end, max);
+  }
+
+  const Facet &
+  facet () const
+  {
+    return cvt;
+  }
+
+private:
+  const Facet &cvt;
+};
+
+#endif // DIRECT_CODECVT_H
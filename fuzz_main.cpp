@@ -0,0 +1,124 @@
+// Copyright 2020-2023 Dimitrij Mijoski
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Runs a fuzz target written for libFuzzer without libFuzzer, for compilers
+// that do not have it. Every file given on the command line is run once,
+// e.g. a crash that libFuzzer found. With -random=N, N random inputs of up
+// to 64 bytes are run instead, made mostly of bytes that are interesting in
+// UTF-8 and UTF-16, and the rate is printed. If the target has a custom
+// mutator, most inputs are mutations of the previous one.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+extern "C" int
+LLVMFuzzerTestOneInput (const uint8_t *data, size_t size);
+
+#ifdef __GNUC__
+extern "C" __attribute__ ((weak)) size_t
+LLVMFuzzerCustomMutator (uint8_t *data, size_t size, size_t max_size,
+			 unsigned int seed);
+#else
+const auto LLVMFuzzerCustomMutator = nullptr;
+#endif
+
+namespace {
+
+mt19937 gen (1);
+
+const uint8_t interesting_bytes[]
+  = {0x00, 0x01, 0x62, 0x7F, 0x80, 0x8F, 0x90, 0x9F, 0xA0, 0xBF, 0xC0, 0xC1,
+     0xC2, 0xDF, 0xE0, 0xE1, 0xEC, 0xED, 0xEE, 0xEF, 0xF0, 0xF1, 0xF3, 0xF4,
+     0xF5, 0xFE, 0xFF, 0xD7, 0xD8, 0xDB, 0xDC, 0xFD};
+
+uint8_t
+random_byte ()
+{
+  auto r = gen ();
+  return r % 4 ? interesting_bytes[(r >> 8) % sizeof (interesting_bytes)]
+	       : uint8_t (r >> 8);
+}
+
+int
+run_random (unsigned long runs)
+{
+  const size_t max_size = 64;
+  auto input = vector<uint8_t> (max_size);
+  size_t size = 0;
+  auto t0 = chrono::steady_clock::now ();
+  for (unsigned long i = 0; i != runs; ++i)
+    {
+      if (LLVMFuzzerCustomMutator && gen () % 16)
+	size = LLVMFuzzerCustomMutator (input.data (), size, max_size, gen ());
+      else
+	{
+	  size = gen () % (max_size + 1);
+	  generate_n (input.begin (), size, random_byte);
+	}
+      LLVMFuzzerTestOneInput (input.data (), size);
+    }
+  auto t = chrono::duration<double> (chrono::steady_clock::now () - t0);
+  printf ("%lu random inputs, %.0f per second\n", runs, runs / t.count ());
+  return 0;
+}
+
+} // namespace
+
+// The generic mutator of libFuzzer, for custom mutators. Changes, inserts or
+// erases one byte.
+extern "C" size_t
+LLVMFuzzerMutate (uint8_t *data, size_t size, size_t max_size)
+{
+  auto r = gen ();
+  if (r % 3 == 0 && size < max_size)
+    {
+      auto i = (r >> 2) % (size + 1);
+      copy_backward (data + i, data + size, data + size + 1);
+      data[i] = random_byte ();
+      return size + 1;
+    }
+  if (size == 0)
+    return 0;
+  auto i = (r >> 2) % size;
+  if (r % 3 == 1)
+    {
+      copy (data + i + 1, data + size, data + i);
+      return size - 1;
+    }
+  data[i] = random_byte ();
+  return size;
+}
+
+int
+main (int argc, char *argv[])
+{
+  if (argc == 2 && strncmp (argv[1], "-random=", 8) == 0)
+    return run_random (strtoul (argv[1] + 8, nullptr, 10));
+  if (argc < 2)
+    {
+      printf ("Usage: %s FILE... | -random=N\n", argv[0]);
+      return 2;
+    }
+  for (int i = 1; i < argc; ++i)
+    {
+      auto file = ifstream (argv[i], ios::binary);
+      if (!file)
+	{
+	  printf ("Can not open %s\n", argv[i]);
+	  return 1;
+	}
+      auto input = vector<uint8_t> (istreambuf_iterator<char> (file), {});
+      LLVMFuzzerTestOneInput (input.data (), input.size ());
+    }
+  return 0;
+}
@@ -0,0 +1,302 @@
+// Copyright 2020-2023 Dimitrij Mijoski
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Structure-aware fuzz target for the facets that convert from UTF-16 bytes,
+// in both byte orders, checked against a reference decoder. Build it like
+// fuzz_utf8_utf16.cpp.
+//
+// The first byte of the input is a header. Bit 0 selects little endian,
+// bits 1 to 7 are the size of the output buffer, 127 means large enough for
+// any result. The rest are the UTF-16 bytes, possibly an odd number of them.
+// Every input is decoded with in() and length() of the UTF-32 and the UCS-2
+// facets of its byte order and compared with the reference. Then the bytes
+// of every unit are swapped and the same is checked with the facets of the
+// other byte order.
+//
+// The custom mutator works on code units. It inserts, swaps and orphans
+// surrogates, truncates to an odd number of bytes and flips the byte order,
+// and leaves the rest to the generic mutator of libFuzzer.
+
+#include "simd_codecvt.h"
+
+#include <algorithm>
+#include <codecvt>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <locale>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+extern "C" size_t
+LLVMFuzzerMutate (uint8_t *data, size_t size, size_t max_size);
+
+namespace {
+
+// libstdc++ before GCC 13 gives error instead of partial for an incomplete
+// code unit, so there the result and from_next of its facets are not checked
+// for an odd number of bytes.
+#if defined(_GLIBCXX_RELEASE) && _GLIBCXX_RELEASE < 13
+const bool stock_odd_byte_error = true;
+#else
+const bool stock_odd_byte_error = false;
+#endif
+
+const size_t unlimited_room = 127;
+
+struct decoded
+{
+  codecvt_base::result res;
+  size_t from_next;
+  vector<char32_t> out;
+  int length;
+};
+
+unsigned
+read_unit (const uint8_t *p, bool little_endian)
+{
+  return little_endian ? p[0] | p[1] << 8 : p[0] << 8 | p[1];
+}
+
+// Reference decoder of UTF-16 bytes to UTF-32, or to UCS-2 where every
+// surrogate is an error, written from the definition of UTF-16 and the
+// semantics of in(). It stops with partial when the output is full, before
+// it looks at the next character.
+void
+reference_decode (const uint8_t *data, size_t size, bool little_endian,
+		  bool ucs2, size_t room, decoded &d)
+{
+  d.out.clear ();
+  size_t i = 0;
+  d.res = codecvt_base::ok;
+  while (i != size)
+    {
+      if (d.out.size () == room || size - i < 2)
+	{
+	  d.res = codecvt_base::partial;
+	  break;
+	}
+      auto u = read_unit (data + i, little_endian);
+      if (u < 0xD800 || u > 0xDFFF)
+	{
+	  d.out.push_back (u);
+	  i += 2;
+	  continue;
+	}
+      if (ucs2 || u > 0xDBFF)
+	{
+	  d.res = codecvt_base::error;
+	  break;
+	}
+      if (size - i < 4)
+	{
+	  d.res = codecvt_base::partial;
+	  break;
+	}
+      auto u2 = read_unit (data + i + 2, little_endian);
+      if (u2 < 0xDC00 || u2 > 0xDFFF)
+	{
+	  d.res = codecvt_base::error;
+	  break;
+	}
+      d.out.push_back (0x10000 + ((u - 0xD800) << 10) + (u2 - 0xDC00));
+      i += 4;
+    }
+  d.from_next = i;
+  // length() stops where in() stops, with room as the limit.
+  d.length = int (i);
+}
+
+template <class InternT>
+void
+run_facet (const codecvt<InternT, char, mbstate_t> &cvt, const uint8_t *data,
+	   size_t size, size_t room, decoded &d)
+{
+  static vector<char> ext;
+  static vector<InternT> intern;
+  ext.assign (data, data + size);
+  ext.push_back (0);
+  intern.assign (room + 1, 0);
+  auto state = mbstate_t{};
+  auto from_next = (const char *) nullptr;
+  auto to_next = (InternT *) nullptr;
+  d.res = cvt.in (state, ext.data (), ext.data () + size, from_next,
+		  intern.data (), intern.data () + room, to_next);
+  d.from_next = from_next - ext.data ();
+  d.out.assign (intern.data (), to_next);
+  state = {};
+  d.length = cvt.length (state, ext.data (), ext.data () + size, room);
+}
+
+struct fuzz_facet
+{
+  const char *name;
+  bool stock;
+  bool little_endian;
+  bool ucs2;
+  void (*run) (const uint8_t *data, size_t size, size_t room, decoded &d);
+};
+
+template <class Facet>
+void
+run_static (const uint8_t *data, size_t size, size_t room, decoded &d)
+{
+  static const Facet cvt;
+  run_facet (cvt, data, size, room, d);
+}
+
+const auto le = codecvt_mode::little_endian;
+
+const fuzz_facet facets[] = {
+  {"codecvt_utf16<char32_t> BE", true, false, false,
+   run_static<codecvt_utf16<char32_t>>},
+  {"codecvt_utf16<char32_t> LE", true, true, false,
+   run_static<codecvt_utf16<char32_t, 0x10FFFF, le>>},
+  {"codecvt_utf16<char16_t> BE", true, false, true,
+   run_static<codecvt_utf16<char16_t>>},
+  {"codecvt_utf16<char16_t> LE", true, true, true,
+   run_static<codecvt_utf16<char16_t, 0x10FFFF, le>>},
+  {"simd_codecvt_utf16<char32_t> BE", false, false, false,
+   run_static<simd_codecvt_utf16<char32_t>>},
+  {"simd_codecvt_utf16<char32_t> LE", false, true, false,
+   run_static<simd_codecvt_utf16<char32_t, le>>},
+  {"simd_codecvt_utf16<char16_t> BE", false, false, true,
+   run_static<simd_codecvt_utf16<char16_t>>},
+  {"simd_codecvt_utf16<char16_t> LE", false, true, true,
+   run_static<simd_codecvt_utf16<char16_t, le>>},
+};
+
+const char *const result_names[] = {"ok", "partial", "error", "noconv"};
+
+void
+check (const fuzz_facet &f, const uint8_t *data, size_t size, size_t room)
+{
+  static decoded expected, actual;
+  reference_decode (data, size, f.little_endian, f.ucs2, room, expected);
+  f.run (data, size, room, actual);
+  auto check_res = !(f.stock && stock_odd_byte_error && size % 2);
+  if ((!check_res
+       || (expected.res == actual.res
+	   && expected.from_next == actual.from_next))
+      && expected.out == actual.out && expected.length == actual.length)
+    return;
+  fprintf (stderr,
+	   "%s differs from the reference on %zu bytes, room %zu:\n"
+	   "  result    %s, expected %s\n"
+	   "  from_next %zu, expected %zu\n"
+	   "  to_next   %zu, expected %zu\n"
+	   "  length    %d, expected %d\n",
+	   f.name, size, room, result_names[actual.res],
+	   result_names[expected.res], actual.from_next, expected.from_next,
+	   actual.out.size (), expected.out.size (), actual.length,
+	   expected.length);
+  abort ();
+}
+
+} // namespace
+
+extern "C" int
+LLVMFuzzerTestOneInput (const uint8_t *data, size_t size)
+{
+  if (size == 0)
+    return 0;
+  auto little_endian = bool (data[0] & 1);
+  auto room = size_t (data[0] >> 1);
+  if (room == unlimited_room)
+    room = size;
+  static vector<uint8_t> swapped;
+  swapped.assign (data + 1, data + size);
+  for (size_t i = 0; i + 1 < swapped.size (); i += 2)
+    swap (swapped[i], swapped[i + 1]);
+  for (auto &f : facets)
+    if (f.little_endian == little_endian)
+      check (f, data + 1, size - 1, room);
+    else
+      check (f, swapped.data (), swapped.size (), room);
+  return 0;
+}
+
+extern "C" size_t
+LLVMFuzzerCustomMutator (uint8_t *data, size_t size, size_t max_size,
+			 unsigned int seed)
+{
+  auto gen = minstd_rand (seed);
+  if (size == 0 || max_size < 5)
+    return LLVMFuzzerMutate (data, size, max_size);
+  auto little_endian = bool (data[0] & 1);
+  auto units = (size - 1) / 2;
+  auto unit_at = [&] (size_t i) { return data + 1 + 2 * i; };
+  auto put = [&] (uint8_t *p, unsigned u) {
+    p[!little_endian] = u & 0xFF;
+    p[little_endian] = u >> 8;
+  };
+  // Inserts n units at unit index i, keeping an odd trailing byte.
+  auto insert = [&] (size_t i, size_t n) {
+    if (size + 2 * n > max_size)
+      return false;
+    auto p = unit_at (i);
+    copy_backward (p, data + size, data + size + 2 * n);
+    size += 2 * n;
+    units += n;
+    return true;
+  };
+  auto random_unit = [&] (unsigned lo, unsigned hi) {
+    return lo + gen () % (hi - lo + 1);
+  };
+  auto pos = units ? gen () % units : 0;
+  switch (gen () % 9)
+    {
+    case 0: // insert a lone high surrogate
+      if (insert (pos, 1))
+	put (unit_at (pos), random_unit (0xD800, 0xDBFF));
+      break;
+    case 1: // insert a lone low surrogate
+      if (insert (pos, 1))
+	put (unit_at (pos), random_unit (0xDC00, 0xDFFF));
+      break;
+    case 2: // insert a valid pair
+      if (insert (pos, 2))
+	{
+	  put (unit_at (pos), random_unit (0xD800, 0xDBFF));
+	  put (unit_at (pos + 1), random_unit (0xDC00, 0xDFFF));
+	}
+      break;
+    case 3: // swap two neighbouring units, e.g. a pair into low, high
+      if (pos + 1 < units)
+	swap_ranges (unit_at (pos), unit_at (pos + 1), unit_at (pos + 1));
+      break;
+    case 4: // orphan a surrogate by removing the other half of a pair
+      for (size_t k = 0; k != units; ++k)
+	{
+	  auto i = (pos + k) % units;
+	  if (i + 1 == units)
+	    continue;
+	  auto u = read_unit (unit_at (i), little_endian);
+	  auto u2 = read_unit (unit_at (i + 1), little_endian);
+	  if (u < 0xD800 || u > 0xDBFF || u2 < 0xDC00 || u2 > 0xDFFF)
+	    continue;
+	  auto removed = unit_at (i + gen () % 2);
+	  copy (removed + 2, data + size, removed);
+	  return size - 2;
+	}
+      return LLVMFuzzerMutate (data, size, max_size);
+    case 5: // truncate to an odd number of bytes
+      if (size <= 2)
+	return LLVMFuzzerMutate (data, size, max_size);
+      size = 1 + 2 * (gen () % units) + 1;
+      break;
+    case 6: // flip the byte order, keeping the units
+      data[0] ^= 1;
+      for (size_t i = 0; i != units; ++i)
+	swap (unit_at (i)[0], unit_at (i)[1]);
+      break;
+    case 7: // change the size of the output
+      data[0] = (data[0] & 1) | (gen () % 128) << 1;
+      break;
+    default:
+      return LLVMFuzzerMutate (data, size, max_size);
+    }
+  return size;
+}
@@ -0,0 +1,205 @@
+// Copyright 2020-2023 Dimitrij Mijoski
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Differential fuzz target for the facets that convert between UTF-8 and
+// UTF-16 and must give the same results. Build it with libFuzzer, see
+// CMakeLists.txt, or with fuzz_main.cpp to replay inputs without it.
+//
+// The first byte of the input is the size of the output buffers, 255 means
+// large enough for any result. The rest is the UTF-8 input of in() and
+// length() and, read as little endian code units, the UTF-16 input of
+// out(). The result, from_next, to_next and the output of every facet are
+// compared with those of the first facet, and the process aborts on the
+// first difference. All facets are created once, so that libFuzzer can run
+// millions of inputs per second in one process.
+
+#include "dfa_codecvt.h"
+#include "simd_codecvt.h"
+
+#include <codecvt>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <locale>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+// libstdc++ before GCC 13 accepts some malformed UTF-8, e.g. encoded
+// surrogates, so there its facets are only compared with each other.
+#if defined(_GLIBCXX_RELEASE) && _GLIBCXX_RELEASE < 13
+const bool compare_stock_with_others = false;
+#else
+const bool compare_stock_with_others = true;
+#endif
+
+// What one facet did with one input. The offsets are relative to the start
+// of the buffers and the output units are widened.
+struct conversion
+{
+  codecvt_base::result res;
+  size_t from_next;
+  size_t to_next;
+  int length;
+  vector<char32_t> out;
+};
+
+// Calls in() and length() on [data, data + size) and out() on the code units
+// of it, with room units in the output buffers. The buffers are static and
+// keep their capacity between inputs.
+template <class InternT, class ExternT>
+void
+run_facet (const codecvt<InternT, ExternT, mbstate_t> &cvt,
+	   const unsigned char *data, size_t size, size_t room,
+	   conversion &in, conversion &out)
+{
+  static vector<ExternT> ext;
+  static vector<InternT> intern;
+  auto state = mbstate_t{};
+  auto ext_next = (const ExternT *) nullptr;
+  auto intern_next = (InternT *) nullptr;
+
+  ext.assign (data, data + size);
+  ext.push_back (0);
+  intern.assign (room + 1, 0);
+  in.res = cvt.in (state, ext.data (), ext.data () + size, ext_next,
+		   intern.data (), intern.data () + room, intern_next);
+  in.from_next = ext_next - ext.data ();
+  in.to_next = intern_next - intern.data ();
+  in.out.assign (intern.data (), intern_next);
+  state = {};
+  in.length = cvt.length (state, ext.data (), ext.data () + size, room);
+
+  static vector<InternT> units;
+  static vector<ExternT> bytes;
+  auto intern_in_next = (const InternT *) nullptr;
+  auto ext_out_next = (ExternT *) nullptr;
+  units.clear ();
+  for (size_t i = 0; i + 1 < size; i += 2)
+    units.push_back (InternT (data[i] | data[i + 1] << 8));
+  units.push_back (0);
+  bytes.assign (room + 1, 0);
+  state = {};
+  out.res = cvt.out (state, units.data (), units.data () + units.size () - 1,
+		     intern_in_next, bytes.data (), bytes.data () + room,
+		     ext_out_next);
+  out.from_next = intern_in_next - units.data ();
+  out.to_next = ext_out_next - bytes.data ();
+  out.out.assign (bytes.data (), ext_out_next);
+  for (auto &c : out.out)
+    c &= 0xFF;
+  out.length = 0;
+}
+
+struct fuzz_facet
+{
+  const char *name;
+  bool stock; // from the standard library
+  void (*run) (const unsigned char *data, size_t size, size_t room,
+	       conversion &in, conversion &out);
+};
+
+const fuzz_facet facets[] = {
+  {"codecvt<char16_t, char>", true,
+   [] (const unsigned char *data, size_t size, size_t room, conversion &in,
+       conversion &out) {
+     using codecvt_c16 = codecvt<char16_t, char, mbstate_t>;
+     static auto &cvt = use_facet<codecvt_c16> (locale::classic ());
+     run_facet (cvt, data, size, room, in, out);
+   }},
+  {"codecvt_utf8_utf16<char16_t>", true,
+   [] (const unsigned char *data, size_t size, size_t room, conversion &in,
+       conversion &out) {
+     static const codecvt_utf8_utf16<char16_t> cvt;
+     run_facet (cvt, data, size, room, in, out);
+   }},
+#ifdef __cpp_char8_t
+  {"codecvt<char16_t, char8_t>", true,
+   [] (const unsigned char *data, size_t size, size_t room, conversion &in,
+       conversion &out) {
+     using codecvt_c16_c8 = codecvt<char16_t, char8_t, mbstate_t>;
+     static auto &cvt = use_facet<codecvt_c16_c8> (locale::classic ());
+     run_facet (cvt, data, size, room, in, out);
+   }},
+#endif
+#if _WIN32 || __SIZEOF_WCHAR_T__ >= 2
+  {"codecvt_utf8_utf16<wchar_t>", true,
+   [] (const unsigned char *data, size_t size, size_t room, conversion &in,
+       conversion &out) {
+     static const codecvt_utf8_utf16<wchar_t> cvt;
+     run_facet (cvt, data, size, room, in, out);
+   }},
+#endif
+  {"simd_codecvt_c16", false,
+   [] (const unsigned char *data, size_t size, size_t room, conversion &in,
+       conversion &out) {
+     static const simd_codecvt_c16 cvt;
+     run_facet (cvt, data, size, room, in, out);
+   }},
+  {"dfa_codecvt_c16", false,
+   [] (const unsigned char *data, size_t size, size_t room, conversion &in,
+       conversion &out) {
+     static const dfa_codecvt_c16 cvt;
+     run_facet (cvt, data, size, room, in, out);
+   }},
+};
+
+const char *const result_names[] = {"ok", "partial", "error", "noconv"};
+
+// Aborts if a and b differ.
+void
+compare (const char *what, const char *name_a, const conversion &a,
+	 const char *name_b, const conversion &b)
+{
+  if (a.res == b.res && a.from_next == b.from_next && a.to_next == b.to_next
+      && a.length == b.length && a.out == b.out)
+    return;
+  fprintf (stderr,
+	   "%s of %s and %s differ:\n"
+	   "  result    %s, %s\n"
+	   "  from_next %zu, %zu\n"
+	   "  to_next   %zu, %zu\n"
+	   "  length    %d, %d\n",
+	   what, name_a, name_b, result_names[a.res], result_names[b.res],
+	   a.from_next, b.from_next, a.to_next, b.to_next, a.length, b.length);
+  abort ();
+}
+
+} // namespace
+
+extern "C" int
+LLVMFuzzerTestOneInput (const uint8_t *data, size_t size)
+{
+  if (size == 0)
+    return 0;
+  auto room = data[0] == 255 ? 4 * size : size_t (data[0]);
+  const size_t n = sizeof (facets) / sizeof (facets[0]);
+  static conversion in[n], out[n];
+  // The first facet of each kind is the reference of that kind.
+  const fuzz_facet *first[2] = {};
+  size_t first_index[2] = {};
+  for (size_t i = 0; i != n; ++i)
+    {
+      auto &f = facets[i];
+      f.run (data + 1, size - 1, room, in[i], out[i]);
+      auto &ref = first[f.stock];
+      if (!ref)
+	{
+	  ref = &f;
+	  first_index[f.stock] = i;
+	  continue;
+	}
+      auto r = first_index[f.stock];
+      compare ("in()", ref->name, in[r], f.name, in[i]);
+      compare ("out()", ref->name, out[r], f.name, out[i]);
+    }
+  if (compare_stock_with_others)
+    {
+      auto s = first_index[true], o = first_index[false];
+      compare ("in()", facets[s].name, in[s], facets[o].name, in[o]);
+      compare ("out()", facets[s].name, out[s], facets[o].name, out[o]);
+    }
+  return 0;
+}
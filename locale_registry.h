@@ -0,0 +1,44 @@
+// Copyright 2020-2023 Dimitrij Mijoski
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef LOCALE_REGISTRY_H
+#define LOCALE_REGISTRY_H
+
+#include <locale>
+
+// Process-wide locales for facet configurations, one per facet type, e.g.
+// registered_locale<std::codecvt_utf8<wchar_t>> () or
+// registered_locale<simd_codecvt_utf16<char16_t, std::little_endian>> ().
+// Every locale is the classic locale with one Facet installed. It is built
+// on first use and never modified afterwards, so it can be used from any
+// thread without locking.
+//
+// Building a locale per stream, like
+// std::locale (loc, new std::codecvt_utf8<wchar_t>), allocates the facet and
+// a copy of the whole facet table. Copying a locale atomically increments
+// the reference counts. The functions here only check the guard of a
+// static. Hold on to the returned references and copy the locale only where
+// a copy is needed, e.g. for imbue().
+//
+// The locales are never destroyed, so they stay valid in threads that still
+// run during the destruction of static objects.
+template <class Facet>
+const std::locale &
+registered_locale ()
+{
+  static const std::locale *const loc
+    = new std::locale (std::locale::classic (), new Facet);
+  return *loc;
+}
+
+// The Facet of registered_locale<Facet> ().
+template <class Facet>
+const Facet &
+registered_facet ()
+{
+  static const Facet &facet
+    = std::use_facet<Facet> (registered_locale<Facet> ());
+  return facet;
+}
+
+#endif // LOCALE_REGISTRY_H
@@ -0,0 +1,200 @@
+// Copyright 2020-2023 Dimitrij Mijoski
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef PARALLEL_CODECVT_H
+#define PARALLEL_CODECVT_H
+
+#include <algorithm>
+#include <cstddef>
+#include <locale>
+#include <memory>
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace parallel_codecvt_detail {
+
+// Outcome of converting one slice into its own buffer.
+template <class InternT> struct slice
+{
+  const char *begin;
+  const char *end;
+  std::unique_ptr<InternT[]> out;
+  size_t produced;
+  size_t consumed;
+  std::codecvt_base::result res;
+};
+
+// Splits [from, from_end) into about n slices and calls cut (lo, p) to move
+// every cut p back, but not below lo. Empty slices are dropped.
+template <class InternT, class Cut>
+std::vector<slice<InternT>>
+make_slices (const char *from, const char *from_end, size_t n, Cut cut)
+{
+  auto ret = std::vector<slice<InternT>> ();
+  auto size = size_t (from_end - from);
+  auto begin = from;
+  for (size_t i = 1; i <= n; ++i)
+    {
+      auto end = i == n ? from_end : cut (begin, from + size / n * i);
+      if (end != begin)
+	ret.push_back ({begin, end, nullptr, 0, 0, std::codecvt_base::ok});
+      begin = end;
+    }
+  return ret;
+}
+
+// Converts every slice with a fresh state into a buffer of one internal
+// unit per bytes_per_unit external bytes.
+template <class InternT>
+void
+convert_slices (const std::codecvt<InternT, char, mbstate_t> &cvt,
+		thread_pool &pool, std::vector<slice<InternT>> &slices,
+		size_t bytes_per_unit)
+{
+  pool.parallel_for (slices.size (), [&] (size_t i) {
+    auto &s = slices[i];
+    auto size = size_t (s.end - s.begin);
+    auto len = (size + bytes_per_unit - 1) / bytes_per_unit;
+    s.out.reset (new InternT[len]);
+    auto state = mbstate_t ();
+    auto from_next = s.begin;
+    auto to_next = s.out.get ();
+    s.res = cvt.in (state, s.begin, s.end, from_next, s.out.get (),
+		    s.out.get () + len, to_next);
+    s.consumed = from_next - s.begin;
+    s.produced = to_next - s.out.get ();
+  });
+}
+
+// Places the outputs of the slices with a prefix sum and decides the result
+// that a single call to in() would give. A slice other than the last that
+// ends with an incomplete character is followed by a byte or unit that can
+// not continue it, so it is an error. If the output is too small, the slice
+// where it fills up is converted again straight into it.
+template <class InternT>
+std::codecvt_base::result
+stitch_slices (const std::codecvt<InternT, char, mbstate_t> &cvt,
+	       thread_pool &pool, std::vector<slice<InternT>> &slices,
+	       const char *from, const char *&from_next, InternT *to,
+	       InternT *to_end, InternT *&to_next)
+{
+  using namespace std;
+  auto res = codecvt_base::ok;
+  from_next = from;
+  to_next = to;
+  auto offsets = vector<size_t> ();
+  size_t used = 0;
+  for (size_t i = 0; i != slices.size (); ++i)
+    {
+      auto &s = slices[i];
+      // With a full output in() returns partial before it looks at the
+      // next character, so the slice must be converted again also if it
+      // fills the output exactly and does not end with ok.
+      auto room = size_t (to_end - to) - used;
+      if (s.produced > room
+	  || (s.produced == room && s.res != codecvt_base::ok))
+	{
+	  auto state = mbstate_t ();
+	  res = cvt.in (state, s.begin, s.end, from_next, to + used, to_end,
+			to_next);
+	  break;
+	}
+      offsets.push_back (used);
+      used += s.produced;
+      from_next = s.begin + s.consumed;
+      to_next = to + used;
+      if (s.res != codecvt_base::ok)
+	{
+	  res = s.res;
+	  if (res == codecvt_base::partial && i + 1 != slices.size ())
+	    res = codecvt_base::error;
+	  break;
+	}
+    }
+  pool.parallel_for (offsets.size (), [&] (size_t i) {
+    auto &s = slices[i];
+    copy (s.out.get (), s.out.get () + s.produced, to + offsets[i]);
+  });
+  return res;
+}
+
+inline size_t
+slice_count (thread_pool &pool, size_t size, size_t min_slice)
+{
+  auto n = size / std::max<size_t> (min_slice, 1);
+  return std::clamp<size_t> (n, 1, 4 * size_t (pool.size ()));
+}
+
+} // namespace parallel_codecvt_detail
+
+// Does the same as cvt.in (state, from, from_end, from_next, to, to_end,
+// to_next) with a facet that converts from UTF-8, with the same result,
+// from_next and to_next, but on all threads of pool. The input is split in
+// slices of at least min_slice bytes. Every cut is moved back to a lead byte
+// so that the slices can be converted independently, each with a fresh
+// state, and the outputs are placed with a prefix sum. Errors are reported
+// at the same offset as by a single call.
+//
+// The slices are converted into temporary buffers, up to one internal unit
+// per byte of input.
+template <class InternT>
+std::codecvt_base::result
+parallel_utf8_in (const std::codecvt<InternT, char, mbstate_t> &cvt,
+		  thread_pool &pool, const char *from, const char *from_end,
+		  const char *&from_next, InternT *to, InternT *to_end,
+		  InternT *&to_next, size_t min_slice = size_t (1) << 20)
+{
+  using namespace parallel_codecvt_detail;
+  // A character has at most three continuation bytes. If there are more,
+  // the input is malformed there and any cut gives the same result.
+  auto cut = [] (const char *lo, const char *p) {
+    auto q = p;
+    for (int i = 0; i < 3 && q > lo && (*q & 0xC0) == 0x80; ++i)
+      --q;
+    return (*q & 0xC0) == 0x80 ? p : q;
+  };
+  auto n = slice_count (pool, from_end - from, min_slice);
+  auto slices = make_slices<InternT> (from, from_end, n, cut);
+  convert_slices (cvt, pool, slices, 1);
+  return stitch_slices (cvt, pool, slices, from, from_next, to, to_end,
+			to_next);
+}
+
+// Like parallel_utf8_in, for a facet that converts from UTF-16 bytes in the
+// given byte order, like codecvt_utf16<char32_t> and
+// codecvt_utf16<char16_t>. The facet must not have the consume_header mode,
+// a byte order mark is only valid at the start of the whole input.
+//
+// The cuts are on even offsets. A slice that would begin with the low
+// surrogate of a pair is repaired by moving the cut back to the high
+// surrogate, so every pair is converted by one slice. The slices are
+// converted into temporary buffers, up to one internal unit per two bytes.
+template <class InternT>
+std::codecvt_base::result
+parallel_utf16_in (const std::codecvt<InternT, char, mbstate_t> &cvt,
+		   thread_pool &pool, bool little_endian, const char *from,
+		   const char *from_end, const char *&from_next, InternT *to,
+		   InternT *to_end, InternT *&to_next,
+		   size_t min_slice = size_t (1) << 20)
+{
+  using namespace parallel_codecvt_detail;
+  auto unit = [little_endian] (const char *p) {
+    auto b = reinterpret_cast<const unsigned char *> (p);
+    return little_endian ? b[0] | b[1] << 8 : b[0] << 8 | b[1];
+  };
+  auto cut = [&] (const char *lo, const char *p) {
+    p = lo + ((p - lo) & ~ptrdiff_t (1));
+    if (p - lo >= 2 && from_end - p >= 2 && (unit (p) & 0xFC00) == 0xDC00
+	&& (unit (p - 2) & 0xFC00) == 0xD800)
+      p -= 2;
+    return p;
+  };
+  auto n = slice_count (pool, from_end - from, min_slice);
+  auto slices = make_slices<InternT> (from, from_end, n, cut);
+  convert_slices (cvt, pool, slices, 2);
+  return stitch_slices (cvt, pool, slices, from, from_next, to, to_end,
+			to_next);
+}
+
+#endif // PARALLEL_CODECVT_H
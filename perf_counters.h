@@ -0,0 +1,171 @@
+// Copyright 2020-2023 Dimitrij Mijoski
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <cstdint>
+
+// Hardware performance counters of the calling thread, read with
+// perf_event_open on Linux, for the benchmarks. The counters are opened as
+// one group, so they count over exactly the same instructions, and only in
+// user space, which perf_event_paranoid up to 2 allows.
+//
+// A counter that the CPU, the kernel or the virtual machine does not have
+// is left out and reported as not valid, the others still work. On other
+// systems none is valid.
+
+enum perf_counter
+{
+  perf_cycles,
+  perf_instructions,
+  perf_branch_misses,
+  perf_l1d_misses, // L1 data cache read misses
+  perf_llc_misses, // last level cache read misses
+  perf_counter_count
+};
+
+const char *const perf_counter_names[perf_counter_count]
+  = {"cycles", "instructions", "branch-misses", "L1D-misses", "LLC-misses"};
+
+// Counts of every counter, summed over the measured intervals.
+struct perf_counts
+{
+  double value[perf_counter_count] = {};
+  bool valid[perf_counter_count] = {};
+};
+
+class perf_counter_group
+{
+public:
+  perf_counter_group ();
+  ~perf_counter_group ();
+  perf_counter_group (const perf_counter_group &) = delete;
+  perf_counter_group &operator= (const perf_counter_group &) = delete;
+
+  // True if at least one counter could be opened.
+  bool
+  available () const
+  {
+    return leader != -1;
+  }
+
+  // Counts from start () to stop () are added to counts. Intervals must not
+  // nest.
+  void start ();
+  void stop (perf_counts &counts);
+
+private:
+  int fds[perf_counter_count];
+  int leader = -1;
+  int opened = 0;
+  perf_counter order[perf_counter_count]; // of the values in a group read
+};
+
+#ifdef __linux__
+
+inline perf_counter_group::perf_counter_group ()
+{
+  const uint64_t cache_read_miss
+    = PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+  const struct
+  {
+    uint32_t type;
+    uint64_t config;
+  } events[perf_counter_count] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | cache_read_miss},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | cache_read_miss},
+  };
+  for (int i = 0; i != perf_counter_count; ++i)
+    {
+      auto attr = perf_event_attr{};
+      attr.size = sizeof (attr);
+      attr.type = events[i].type;
+      attr.config = events[i].config;
+      attr.disabled = leader == -1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED
+			 | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      fds[i] = syscall (SYS_perf_event_open, &attr, 0, -1, leader, 0);
+      if (fds[i] == -1)
+	continue;
+      if (leader == -1)
+	leader = fds[i];
+      order[opened++] = perf_counter (i);
+    }
+}
+
+inline perf_counter_group::~perf_counter_group ()
+{
+  for (auto fd : fds)
+    if (fd != -1)
+      close (fd);
+}
+
+inline void
+perf_counter_group::start ()
+{
+  if (leader == -1)
+    return;
+  ioctl (leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl (leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+inline void
+perf_counter_group::stop (perf_counts &counts)
+{
+  if (leader == -1)
+    return;
+  ioctl (leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  // nr, time_enabled, time_running, then a value per counter.
+  uint64_t data[3 + perf_counter_count];
+  auto size = 8 * (3 + opened);
+  if (read (leader, data, size) != size || data[0] != uint64_t (opened))
+    return;
+  // The counters are multiplexed if there are more groups than the CPU can
+  // count at once, then the counts are extrapolated to the whole interval.
+  // A group that did not run at all counts nothing.
+  if (data[2] == 0)
+    return;
+  auto scale = double (data[1]) / data[2];
+  for (int i = 0; i != opened; ++i)
+    {
+      counts.value[order[i]] += data[3 + i] * scale;
+      counts.valid[order[i]] = true;
+    }
+}
+
+#else
+
+inline perf_counter_group::perf_counter_group ()
+{
+  for (auto &fd : fds)
+    fd = -1;
+}
+
+inline perf_counter_group::~perf_counter_group () {}
+
+inline void
+perf_counter_group::start ()
+{
+}
+
+inline void
+perf_counter_group::stop (perf_counts &)
+{
+}
+
+#endif
+
+#endif // PERF_COUNTERS_H
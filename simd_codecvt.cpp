@@ -0,0 +1,166 @@
+// Copyright 2020-2023 Dimitrij Mijoski
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "simd_codecvt.h"
+#include "utf_kernels.h"
+
+#include <algorithm>
+
+using namespace std;
+
+template <class InternT>
+codecvt_base::result
+simd_codecvt_utf8<InternT>::do_out (state_type &, const intern_type *from,
+				    const intern_type *from_end,
+				    const intern_type *&from_next,
+				    extern_type *to, extern_type *to_end,
+				    extern_type *&to_next) const
+{
+  return convert_out (from, from_end, from_next, to, to_end, to_next);
+}
+
+template <class InternT>
+codecvt_base::result
+simd_codecvt_utf8<InternT>::do_unshift (state_type &, extern_type *to,
+					extern_type *,
+					extern_type *&to_next) const
+{
+  to_next = to;
+  return codecvt_base::noconv;
+}
+
+template <class InternT>
+codecvt_base::result
+simd_codecvt_utf8<InternT>::do_in (state_type &, const extern_type *from,
+				   const extern_type *from_end,
+				   const extern_type *&from_next,
+				   intern_type *to, intern_type *to_end,
+				   intern_type *&to_next) const
+{
+  return convert_in (from, from_end, from_next, to, to_end, to_next);
+}
+
+template <class InternT>
+int
+simd_codecvt_utf8<InternT>::do_encoding () const throw ()
+{
+  return 0;
+}
+
+template <class InternT>
+bool
+simd_codecvt_utf8<InternT>::do_always_noconv () const throw ()
+{
+  return false;
+}
+
+template <class InternT>
+int
+simd_codecvt_utf8<InternT>::do_length (state_type &, const extern_type *from,
+				       const extern_type *end,
+				       size_t max) const
+{
+  return convert_length (from, end, max);
+}
+
+template <class InternT>
+int
+simd_codecvt_utf8<InternT>::convert_length (const extern_type *from,
+					    const extern_type *end, size_t max)
+{
+  return length_by_kernel<InternT> (
+    utf8_kernels<InternT>::in, reinterpret_cast<const unsigned char *> (from),
+    reinterpret_cast<const unsigned char *> (end), max);
+}
+
+template <class InternT>
+int
+simd_codecvt_utf8<InternT>::do_max_length () const throw ()
+{
+  return 4;
+}
+
+template class simd_codecvt_utf8<char32_t>;
+template class simd_codecvt_utf8<char16_t>;
+
+template <class InternT, codecvt_mode Mode>
+codecvt_base::result
+simd_codecvt_utf16<InternT, Mode>::do_out (
+  state_type &, const intern_type *from, const intern_type *from_end,
+  const intern_type *&from_next, extern_type *to, extern_type *to_end,
+  extern_type *&to_next) const
+{
+  return convert_out (from, from_end, from_next, to, to_end, to_next);
+}
+
+template <class InternT, codecvt_mode Mode>
+codecvt_base::result
+simd_codecvt_utf16<InternT, Mode>::do_unshift (state_type &, extern_type *to,
+					       extern_type *,
+					       extern_type *&to_next) const
+{
+  to_next = to;
+  return codecvt_base::noconv;
+}
+
+template <class InternT, codecvt_mode Mode>
+codecvt_base::result
+simd_codecvt_utf16<InternT, Mode>::do_in (
+  state_type &, const extern_type *from, const extern_type *from_end,
+  const extern_type *&from_next, intern_type *to, intern_type *to_end,
+  intern_type *&to_next) const
+{
+  return convert_in (from, from_end, from_next, to, to_end, to_next);
+}
+
+template <class InternT, codecvt_mode Mode>
+int
+simd_codecvt_utf16<InternT, Mode>::do_encoding () const throw ()
+{
+  return 0;
+}
+
+template <class InternT, codecvt_mode Mode>
+bool
+simd_codecvt_utf16<InternT, Mode>::do_always_noconv () const throw ()
+{
+  return false;
+}
+
+template <class InternT, codecvt_mode Mode>
+int
+simd_codecvt_utf16<InternT, Mode>::do_length (state_type &,
+					      const extern_type *from,
+					      const extern_type *end,
+					      size_t max) const
+{
+  return convert_length (from, end, max);
+}
+
+template <class InternT, codecvt_mode Mode>
+int
+simd_codecvt_utf16<InternT, Mode>::convert_length (const extern_type *from,
+						   const extern_type *end,
+						   size_t max)
+{
+  auto kernel = [] (const unsigned char *&from, const unsigned char *from_end,
+		    InternT *&to, InternT *to_end) {
+    return utf16_kernels<InternT>::in (from, from_end, to, to_end,
+				       Mode & little_endian);
+  };
+  return length_by_kernel<InternT> (
+    kernel, reinterpret_cast<const unsigned char *> (from),
+    reinterpret_cast<const unsigned char *> (end), max);
+}
+
+template <class InternT, codecvt_mode Mode>
+int
+simd_codecvt_utf16<InternT, Mode>::do_max_length () const throw ()
+{
+  return 4;
+}
+
+template class simd_codecvt_utf16<char32_t>;
+template class simd_codecvt_utf16<char32_t, little_endian>;
+template class simd_codecvt_utf16<char16_t>;
+template class simd_codecvt_utf16<char16_t, little_endian>;
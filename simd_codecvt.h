@@ -0,0 +1,192 @@
+// Copyright 2020-2023 Dimitrij Mijoski
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SIMD_CODECVT_H
+#define SIMD_CODECVT_H
+
+#include "utf_kernels.h"
+
+#include <codecvt>
+#include <locale>
+
+// Drop-in replacement for codecvt<char32_t, char, mbstate_t> and
+// codecvt<char16_t, char, mbstate_t> that converts between UTF-8 and UTF-32
+// or UTF-16 with the vectorized kernels from utf_kernels.h. It has the same
+// ok/partial/error semantics as the standard facets. Defined for char32_t
+// and char16_t.
+template <class InternT>
+class simd_codecvt_utf8 final : public std::codecvt<InternT, char, mbstate_t>
+{
+public:
+  using result = std::codecvt_base::result;
+  using intern_type = InternT;
+  using extern_type = char;
+  using state_type = mbstate_t;
+
+  explicit simd_codecvt_utf8 (size_t refs = 0)
+    : std::codecvt<InternT, char, mbstate_t> (refs)
+  {
+  }
+
+  // What out (), in () and length () do, without the virtual call, for
+  // direct_codecvt.h. The facet has no state.
+  static result
+  convert_out (const intern_type *from, const intern_type *from_end,
+	       const intern_type *&from_next, extern_type *to,
+	       extern_type *to_end, extern_type *&to_next)
+  {
+    auto t = reinterpret_cast<unsigned char *> (to);
+    auto res = utf8_kernels<InternT>::out (
+      from, from_end, t, reinterpret_cast<unsigned char *> (to_end));
+    from_next = from;
+    to_next = reinterpret_cast<extern_type *> (t);
+    return res;
+  }
+
+  static result
+  convert_in (const extern_type *from, const extern_type *from_end,
+	      const extern_type *&from_next, intern_type *to,
+	      intern_type *to_end, intern_type *&to_next)
+  {
+    auto f = reinterpret_cast<const unsigned char *> (from);
+    auto res = utf8_kernels<InternT>::in (
+      f, reinterpret_cast<const unsigned char *> (from_end), to, to_end);
+    from_next = reinterpret_cast<const extern_type *> (f);
+    to_next = to;
+    return res;
+  }
+
+  static int
+  convert_length (const extern_type *from, const extern_type *end,
+		  size_t max);
+
+protected:
+  result
+  do_out (state_type &state, const intern_type *from,
+	  const intern_type *from_end, const intern_type *&from_next,
+	  extern_type *to, extern_type *to_end,
+	  extern_type *&to_next) const override;
+
+  result
+  do_unshift (state_type &state, extern_type *to, extern_type *to_end,
+	      extern_type *&to_next) const override;
+
+  result
+  do_in (state_type &state, const extern_type *from,
+	 const extern_type *from_end, const extern_type *&from_next,
+	 intern_type *to, intern_type *to_end,
+	 intern_type *&to_next) const override;
+
+  int
+  do_encoding () const throw () override;
+
+  bool
+  do_always_noconv () const throw () override;
+
+  int
+  do_length (state_type &state, const extern_type *from,
+	     const extern_type *end, size_t max) const override;
+
+  int
+  do_max_length () const throw () override;
+};
+
+// Drop-in replacement for codecvt_utf16<char32_t, 0x10FFFF, Mode> and
+// codecvt_utf16<char16_t, 0x10FFFF, Mode>. The external sequence is UTF-16
+// in big endian byte order, or in little endian if Mode has little_endian.
+// With char32_t the internal sequence is UTF-32, with char16_t it is UCS-2.
+// Other flags of Mode are not supported.
+template <class InternT, std::codecvt_mode Mode = std::codecvt_mode (0)>
+class simd_codecvt_utf16 final : public std::codecvt<InternT, char, mbstate_t>
+{
+  static_assert ((Mode & ~std::little_endian) == 0,
+		 "only little_endian is supported");
+
+public:
+  using result = std::codecvt_base::result;
+  using intern_type = InternT;
+  using extern_type = char;
+  using state_type = mbstate_t;
+
+  explicit simd_codecvt_utf16 (size_t refs = 0)
+    : std::codecvt<InternT, char, mbstate_t> (refs)
+  {
+  }
+
+  // What out (), in () and length () do, without the virtual call, for
+  // direct_codecvt.h. The facet has no state.
+  static result
+  convert_out (const intern_type *from, const intern_type *from_end,
+	       const intern_type *&from_next, extern_type *to,
+	       extern_type *to_end, extern_type *&to_next)
+  {
+    auto t = reinterpret_cast<unsigned char *> (to);
+    auto res = utf16_kernels<InternT>::out (
+      from, from_end, t, reinterpret_cast<unsigned char *> (to_end),
+      Mode & std::little_endian);
+    from_next = from;
+    to_next = reinterpret_cast<extern_type *> (t);
+    return res;
+  }
+
+  static result
+  convert_in (const extern_type *from, const extern_type *from_end,
+	      const extern_type *&from_next, intern_type *to,
+	      intern_type *to_end, intern_type *&to_next)
+  {
+    auto f = reinterpret_cast<const unsigned char *> (from);
+    auto res = utf16_kernels<InternT>::in (
+      f, reinterpret_cast<const unsigned char *> (from_end), to, to_end,
+      Mode & std::little_endian);
+    from_next = reinterpret_cast<const extern_type *> (f);
+    to_next = to;
+    return res;
+  }
+
+  static int
+  convert_length (const extern_type *from, const extern_type *end,
+		  size_t max);
+
+protected:
+  result
+  do_out (state_type &state, const intern_type *from,
+	  const intern_type *from_end, const intern_type *&from_next,
+	  extern_type *to, extern_type *to_end,
+	  extern_type *&to_next) const override;
+
+  result
+  do_unshift (state_type &state, extern_type *to, extern_type *to_end,
+	      extern_type *&to_next) const override;
+
+  result
+  do_in (state_type &state, const extern_type *from,
+	 const extern_type *from_end, const extern_type *&from_next,
+	 intern_type *to, intern_type *to_end,
+	 intern_type *&to_next) const override;
+
+  int
+  do_encoding () const throw () override;
+
+  bool
+  do_always_noconv () const throw () override;
+
+  int
+  do_length (state_type &state, const extern_type *from,
+	     const extern_type *end, size_t max) const override;
+
+  int
+  do_max_length () const throw () override;
+};
+
+extern template class simd_codecvt_utf8<char32_t>;
+extern template class simd_codecvt_utf8<char16_t>;
+
+extern template class simd_codecvt_utf16<char32_t>;
+extern template class simd_codecvt_utf16<char32_t, std::little_endian>;
+extern template class simd_codecvt_utf16<char16_t>;
+extern template class simd_codecvt_utf16<char16_t, std::little_endian>;
+
+using simd_codecvt_c32 = simd_codecvt_utf8<char32_t>;
+using simd_codecvt_c16 = simd_codecvt_utf8<char16_t>;
+
+#endif // SIMD_CODECVT_H
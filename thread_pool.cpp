@@ -0,0 +1,79 @@
+// Copyright 2020-2023 Dimitrij Mijoski
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "thread_pool.h"
+
+using namespace std;
+
+thread_pool::thread_pool (unsigned size)
+{
+  if (size == 0)
+    size = max (thread::hardware_concurrency (), 1u);
+  workers.reserve (size - 1);
+  for (unsigned i = 1; i < size; ++i)
+    workers.emplace_back (&thread_pool::worker, this);
+}
+
+thread_pool::~thread_pool ()
+{
+  {
+    lock_guard<std::mutex> lock (mutex);
+    stopping = true;
+  }
+  wake.notify_all ();
+  for (auto &t : workers)
+    t.join ();
+}
+
+void
+thread_pool::run_tasks (const function<void (size_t)> *f, size_t n)
+{
+  for (size_t i; (i = next_index.fetch_add (1)) < n;)
+    (*f) (i);
+}
+
+// A worker that wakes up after the loop has ended finds no job and waits for
+// the next one. It must not take an index, next_index may already belong to
+// the next loop.
+void
+thread_pool::worker ()
+{
+  auto seen = 0ul;
+  unique_lock<std::mutex> lock (mutex);
+  for (;;)
+    {
+      wake.wait (lock, [&] { return stopping || generation != seen; });
+      if (stopping)
+	return;
+      seen = generation;
+      if (!job)
+	continue;
+      auto f = job;
+      auto n = job_size;
+      ++busy;
+      lock.unlock ();
+      run_tasks (f, n);
+      lock.lock ();
+      if (--busy == 0)
+	finished.notify_all ();
+    }
+}
+
+void
+thread_pool::parallel_for (size_t n, const function<void (size_t)> &f)
+{
+  lock_guard<std::mutex> loop_lock (loop_mutex);
+  {
+    lock_guard<std::mutex> lock (mutex);
+    job = &f;
+    job_size = n;
+    next_index = 0;
+    ++generation;
+  }
+  wake.notify_all ();
+  run_tasks (&f, n);
+  unique_lock<std::mutex> lock (mutex);
+  finished.wait (lock, [&] { return busy == 0; });
+  job = nullptr;
+  job_size = 0;
+}
@@ -0,0 +1,63 @@
+// Copyright 2020-2023 Dimitrij Mijoski
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads that run parallel loops. The thread that calls
+// parallel_for takes part in the loop, so a pool of size 1 has no extra
+// threads and runs everything serially.
+class thread_pool
+{
+public:
+  // The default size is the number of hardware threads.
+  explicit thread_pool (unsigned size = 0);
+  ~thread_pool ();
+
+  thread_pool (const thread_pool &) = delete;
+  thread_pool &
+  operator= (const thread_pool &)
+    = delete;
+
+  // Number of threads that run a loop, including the calling one.
+  unsigned
+  size () const
+  {
+    return workers.size () + 1;
+  }
+
+  // Calls f (i) for every i in [0, n), in any order and on any of the
+  // threads, and returns when all calls have returned. The pool runs one
+  // loop at a time, f must not call parallel_for of the same pool.
+  void
+  parallel_for (size_t n, const std::function<void (size_t)> &f);
+
+private:
+  void
+  worker ();
+
+  void
+  run_tasks (const std::function<void (size_t)> *f, size_t n);
+
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable finished;
+  std::mutex loop_mutex; // serializes parallel_for
+  const std::function<void (size_t)> *job = nullptr;
+  size_t job_size = 0;
+  std::atomic<size_t> next_index {0};
+  unsigned long generation = 0;
+  unsigned busy = 0;
+  bool stopping = false;
+};
+
+#endif // THREAD_POOL_H
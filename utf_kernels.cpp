@@ -0,0 +1,2108 @@
+// Copyright 2020-2023 Dimitrij Mijoski
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "utf_kernels.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UTF_KERNELS_X86 1
+#include <immintrin.h>
+#define SIMD_TARGET(x) __attribute__ ((target (x)))
+#else
+#define UTF_KERNELS_X86 0
+#endif
+
+using namespace std;
+
+namespace {
+
+using result = codecvt_base::result;
+
+// Scalar reference. Every kernel falls back to it for the characters it can
+// not handle, so the error and partial offsets are always decided here.
+
+// Decodes one UTF-8 character from a non-empty range. Returns partial if the
+// range ends before the character and all visible bytes of it are valid.
+inline result
+utf8_decode_one (const unsigned char *&from, const unsigned char *from_end,
+		 char32_t &cp)
+{
+  auto avail = from_end - from;
+  unsigned char c1 = from[0];
+  if (c1 < 0x80)
+    {
+      cp = c1;
+      from += 1;
+      return codecvt_base::ok;
+    }
+  if (c1 < 0xC2) // continuation or overlong 2-byte sequence
+    return codecvt_base::error;
+  if (c1 < 0xE0) // 2-byte sequence
+    {
+      if (avail < 2)
+	return codecvt_base::partial;
+      unsigned char c2 = from[1];
+      if ((c2 & 0xC0) != 0x80)
+	return codecvt_base::error;
+      cp = ((c1 & 0x1F) << 6) | (c2 & 0x3F);
+      from += 2;
+      return codecvt_base::ok;
+    }
+  if (c1 < 0xF0) // 3-byte sequence
+    {
+      if (avail < 2)
+	return codecvt_base::partial;
+      unsigned char c2 = from[1];
+      if ((c2 & 0xC0) != 0x80)
+	return codecvt_base::error;
+      if (c1 == 0xE0 && c2 < 0xA0) // overlong
+	return codecvt_base::error;
+      if (c1 == 0xED && c2 >= 0xA0) // surrogate
+	return codecvt_base::error;
+      if (avail < 3)
+	return codecvt_base::partial;
+      unsigned char c3 = from[2];
+      if ((c3 & 0xC0) != 0x80)
+	return codecvt_base::error;
+      cp = ((c1 & 0x0F) << 12) | ((c2 & 0x3F) << 6) | (c3 & 0x3F);
+      from += 3;
+      return codecvt_base::ok;
+    }
+  if (c1 < 0xF5) // 4-byte sequence
+    {
+      if (avail < 2)
+	return codecvt_base::partial;
+      unsigned char c2 = from[1];
+      if ((c2 & 0xC0) != 0x80)
+	return codecvt_base::error;
+      if (c1 == 0xF0 && c2 < 0x90) // overlong
+	return codecvt_base::error;
+      if (c1 == 0xF4 && c2 >= 0x90) // above U+10FFFF
+	return codecvt_base::error;
+      if (avail < 3)
+	return codecvt_base::partial;
+      unsigned char c3 = from[2];
+      if ((c3 & 0xC0) != 0x80)
+	return codecvt_base::error;
+      if (avail < 4)
+	return codecvt_base::partial;
+      unsigned char c4 = from[3];
+      if ((c4 & 0xC0) != 0x80)
+	return codecvt_base::error;
+      cp = ((c1 & 0x07) << 18) | ((c2 & 0x3F) << 12) | ((c3 & 0x3F) << 6)
+	   | (c4 & 0x3F);
+      from += 4;
+      return codecvt_base::ok;
+    }
+  return codecvt_base::error; // above U+10FFFF or invalid byte
+}
+
+// Encodes one scalar value. Returns error for surrogates and values above
+// U+10FFFF, and partial if there is no space for it.
+inline result
+utf8_encode_one (char32_t c, unsigned char *&to, unsigned char *to_end)
+{
+  if (c < 0x80)
+    {
+      if (to == to_end)
+	return codecvt_base::partial;
+      *to++ = c;
+    }
+  else if (c < 0x800)
+    {
+      if (to_end - to < 2)
+	return codecvt_base::partial;
+      *to++ = 0xC0 | (c >> 6);
+      *to++ = 0x80 | (c & 0x3F);
+    }
+  else if (c < 0x10000)
+    {
+      if (c >= 0xD800 && c <= 0xDFFF)
+	return codecvt_base::error;
+      if (to_end - to < 3)
+	return codecvt_base::partial;
+      *to++ = 0xE0 | (c >> 12);
+      *to++ = 0x80 | ((c >> 6) & 0x3F);
+      *to++ = 0x80 | (c & 0x3F);
+    }
+  else if (c <= 0x10FFFF)
+    {
+      if (to_end - to < 4)
+	return codecvt_base::partial;
+      *to++ = 0xF0 | (c >> 18);
+      *to++ = 0x80 | ((c >> 12) & 0x3F);
+      *to++ = 0x80 | ((c >> 6) & 0x3F);
+      *to++ = 0x80 | (c & 0x3F);
+    }
+  else
+    return codecvt_base::error;
+  return codecvt_base::ok;
+}
+
+// Decodes one character into to, which must not be full.
+inline result
+utf8_to_utf32_one (const unsigned char *&from, const unsigned char *from_end,
+		   char32_t *&to)
+{
+  auto res = utf8_decode_one (from, from_end, *to);
+  if (res == codecvt_base::ok)
+    ++to;
+  return res;
+}
+
+result
+utf8_to_utf32_scalar (const unsigned char *&from,
+		      const unsigned char *from_end, char32_t *&to,
+		      char32_t *to_end)
+{
+  while (from != from_end)
+    {
+      if (to == to_end)
+	return codecvt_base::partial;
+      auto res = utf8_to_utf32_one (from, from_end, to);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+result
+utf32_to_utf8_scalar (const char32_t *&from, const char32_t *from_end,
+		      unsigned char *&to, unsigned char *to_end)
+{
+  for (; from != from_end; ++from)
+    {
+      auto res = utf8_encode_one (*from, to, to_end);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+// Decodes one character into to, which must not be full. A character outside
+// of the BMP needs space for a surrogate pair, otherwise partial is returned
+// and nothing is consumed.
+inline result
+utf8_to_utf16_one (const unsigned char *&from, const unsigned char *from_end,
+		   char16_t *&to, char16_t *to_end)
+{
+  auto f = from;
+  auto cp = char32_t ();
+  auto res = utf8_decode_one (f, from_end, cp);
+  if (res != codecvt_base::ok)
+    return res;
+  if (cp < 0x10000)
+    *to++ = cp;
+  else
+    {
+      if (to_end - to < 2)
+	return codecvt_base::partial;
+      cp -= 0x10000;
+      *to++ = 0xD800 + (cp >> 10);
+      *to++ = 0xDC00 + (cp & 0x3FF);
+    }
+  from = f;
+  return codecvt_base::ok;
+}
+
+// Encodes one character that starts with a non-empty range of UTF-16 code
+// units. A high surrogate at the end of the range gives partial, a lone
+// surrogate gives error.
+inline result
+utf16_to_utf8_one (const char16_t *&from, const char16_t *from_end,
+		   unsigned char *&to, unsigned char *to_end)
+{
+  char32_t c = from[0];
+  auto inc = 1;
+  if (c >= 0xD800 && c <= 0xDBFF)
+    {
+      if (from_end - from < 2)
+	return codecvt_base::partial;
+      char32_t c2 = from[1];
+      if (c2 < 0xDC00 || c2 > 0xDFFF)
+	return codecvt_base::error;
+      c = 0x10000 + ((c - 0xD800) << 10) + (c2 - 0xDC00);
+      inc = 2;
+    }
+  else if (c >= 0xDC00 && c <= 0xDFFF)
+    return codecvt_base::error;
+  auto res = utf8_encode_one (c, to, to_end);
+  if (res == codecvt_base::ok)
+    from += inc;
+  return res;
+}
+
+result
+utf8_to_utf16_scalar (const unsigned char *&from,
+		      const unsigned char *from_end, char16_t *&to,
+		      char16_t *to_end)
+{
+  while (from != from_end)
+    {
+      if (to == to_end)
+	return codecvt_base::partial;
+      auto res = utf8_to_utf16_one (from, from_end, to, to_end);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+result
+utf16_to_utf8_scalar (const char16_t *&from, const char16_t *from_end,
+		      unsigned char *&to, unsigned char *to_end)
+{
+  while (from != from_end)
+    {
+      auto res = utf16_to_utf8_one (from, from_end, to, to_end);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+// UTF-16 as bytes in either byte order.
+
+inline char32_t
+read_utf16_unit (const unsigned char *p, bool little_endian)
+{
+  return little_endian ? p[0] | p[1] << 8 : p[0] << 8 | p[1];
+}
+
+inline void
+write_utf16_unit (unsigned char *p, char32_t u, bool little_endian)
+{
+  p[little_endian ? 0 : 1] = u & 0xFF;
+  p[little_endian ? 1 : 0] = u >> 8;
+}
+
+inline bool
+is_surrogate (char32_t u)
+{
+  return (u & 0xFFFFF800) == 0xD800;
+}
+
+// Decodes one character into to, which must not be full.
+inline result
+utf16_bytes_to_utf32_one (const unsigned char *&from,
+			  const unsigned char *from_end, char32_t *&to,
+			  bool little_endian)
+{
+  if (from_end - from < 2)
+    return codecvt_base::partial;
+  auto u = read_utf16_unit (from, little_endian);
+  if (u >= 0xD800 && u <= 0xDBFF)
+    {
+      if (from_end - from < 4)
+	return codecvt_base::partial;
+      auto u2 = read_utf16_unit (from + 2, little_endian);
+      if (u2 < 0xDC00 || u2 > 0xDFFF)
+	return codecvt_base::error;
+      *to++ = 0x10000 + ((u - 0xD800) << 10) + (u2 - 0xDC00);
+      from += 4;
+      return codecvt_base::ok;
+    }
+  if (u >= 0xDC00 && u <= 0xDFFF)
+    return codecvt_base::error;
+  *to++ = u;
+  from += 2;
+  return codecvt_base::ok;
+}
+
+inline result
+utf32_to_utf16_bytes_one (char32_t c, unsigned char *&to,
+			  unsigned char *to_end, bool little_endian)
+{
+  if (is_surrogate (c) || c > 0x10FFFF)
+    return codecvt_base::error;
+  if (c < 0x10000)
+    {
+      if (to_end - to < 2)
+	return codecvt_base::partial;
+      write_utf16_unit (to, c, little_endian);
+      to += 2;
+      return codecvt_base::ok;
+    }
+  if (to_end - to < 4)
+    return codecvt_base::partial;
+  c -= 0x10000;
+  write_utf16_unit (to, 0xD800 + (c >> 10), little_endian);
+  write_utf16_unit (to + 2, 0xDC00 + (c & 0x3FF), little_endian);
+  to += 4;
+  return codecvt_base::ok;
+}
+
+// UCS-2 has no surrogates, every surrogate code unit is an error.
+inline result
+utf16_bytes_to_ucs2_one (const unsigned char *&from,
+			 const unsigned char *from_end, char16_t *&to,
+			 bool little_endian)
+{
+  if (from_end - from < 2)
+    return codecvt_base::partial;
+  auto u = read_utf16_unit (from, little_endian);
+  if (is_surrogate (u))
+    return codecvt_base::error;
+  *to++ = u;
+  from += 2;
+  return codecvt_base::ok;
+}
+
+inline result
+ucs2_to_utf16_bytes_one (char32_t c, unsigned char *&to, unsigned char *to_end,
+			 bool little_endian)
+{
+  if (is_surrogate (c))
+    return codecvt_base::error;
+  if (to_end - to < 2)
+    return codecvt_base::partial;
+  write_utf16_unit (to, c, little_endian);
+  to += 2;
+  return codecvt_base::ok;
+}
+
+// Convert with the scalar code until at least block units from the current
+// position are passed. The vector code uses them after it stops on a
+// surrogate, so that text with many supplementary characters does not go
+// back to the vector code after every one of them.
+inline result
+utf16_bytes_to_utf32_block (const unsigned char *&from,
+			    const unsigned char *from_end, char32_t *&to,
+			    char32_t *to_end, bool little_endian,
+			    ptrdiff_t block)
+{
+  auto block_end = from + min (2 * block, from_end - from);
+  while (from < block_end)
+    {
+      if (to == to_end)
+	return codecvt_base::partial;
+      auto res = utf16_bytes_to_utf32_one (from, from_end, to, little_endian);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+inline result
+utf32_to_utf16_bytes_block (const char32_t *&from, const char32_t *from_end,
+			    unsigned char *&to, unsigned char *to_end,
+			    bool little_endian, ptrdiff_t block)
+{
+  auto block_end = from + min (block, from_end - from);
+  for (; from != block_end; ++from)
+    {
+      auto res = utf32_to_utf16_bytes_one (*from, to, to_end, little_endian);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+result
+utf16_bytes_to_utf32_scalar (const unsigned char *&from,
+			     const unsigned char *from_end, char32_t *&to,
+			     char32_t *to_end, bool little_endian)
+{
+  while (from != from_end)
+    {
+      if (to == to_end)
+	return codecvt_base::partial;
+      auto res = utf16_bytes_to_utf32_one (from, from_end, to, little_endian);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+result
+utf32_to_utf16_bytes_scalar (const char32_t *&from, const char32_t *from_end,
+			     unsigned char *&to, unsigned char *to_end,
+			     bool little_endian)
+{
+  for (; from != from_end; ++from)
+    {
+      auto res = utf32_to_utf16_bytes_one (*from, to, to_end, little_endian);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+result
+utf16_bytes_to_ucs2_scalar (const unsigned char *&from,
+			    const unsigned char *from_end, char16_t *&to,
+			    char16_t *to_end, bool little_endian)
+{
+  while (from != from_end)
+    {
+      if (to == to_end)
+	return codecvt_base::partial;
+      auto res = utf16_bytes_to_ucs2_one (from, from_end, to, little_endian);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+result
+ucs2_to_utf16_bytes_scalar (const char16_t *&from, const char16_t *from_end,
+			    unsigned char *&to, unsigned char *to_end,
+			    bool little_endian)
+{
+  for (; from != from_end; ++from)
+    {
+      auto res = ucs2_to_utf16_bytes_one (*from, to, to_end, little_endian);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+// UTF-8 decoder driven by a state transition table, after the DFA of Bjoern
+// Hoehrmann. Every byte is mapped to a class and the class selects the next
+// state, so validation needs no branches on the byte values. The states say
+// how many continuation bytes are still needed and, right after the lead
+// bytes E0, ED, F0 and F4, which range the second byte must be in.
+enum utf8_dfa_state : uint8_t
+{
+  dfa_accept,
+  dfa_reject,
+  dfa_cont1,   // one more continuation byte
+  dfa_cont2,   // two more
+  dfa_cont3,   // three more
+  dfa_e0,      // after E0, A0..BF, no overlong
+  dfa_ed,      // after ED, 80..9F, no surrogate
+  dfa_f0,      // after F0, 90..BF, no overlong
+  dfa_f4,      // after F4, 80..8F, not above U+10FFFF
+  dfa_num_states
+};
+
+enum utf8_dfa_class : uint8_t
+{
+  dfa_ascii,   // 00..7F
+  dfa_cont_80, // 80..8F
+  dfa_cont_90, // 90..9F
+  dfa_cont_a0, // A0..BF
+  dfa_lead2,   // C2..DF
+  dfa_lead_e0,
+  dfa_lead3,   // E1..EC, EE, EF
+  dfa_lead_ed,
+  dfa_lead_f0,
+  dfa_lead4,   // F1..F3
+  dfa_lead_f4,
+  dfa_invalid, // C0, C1, F5..FF
+  dfa_num_classes
+};
+
+struct utf8_dfa_tables
+{
+  uint8_t byte_class[256] = {};
+  uint8_t lead_payload[dfa_num_classes] = {};
+  uint8_t next[dfa_num_states][dfa_num_classes] = {};
+
+  constexpr utf8_dfa_tables ()
+  {
+    fill (byte_class, byte_class + 256, dfa_invalid);
+    fill (byte_class, byte_class + 0x80, dfa_ascii);
+    fill (byte_class + 0x80, byte_class + 0x90, dfa_cont_80);
+    fill (byte_class + 0x90, byte_class + 0xA0, dfa_cont_90);
+    fill (byte_class + 0xA0, byte_class + 0xC0, dfa_cont_a0);
+    fill (byte_class + 0xC2, byte_class + 0xE0, dfa_lead2);
+    fill (byte_class + 0xE1, byte_class + 0xF0, dfa_lead3);
+    byte_class[0xE0] = dfa_lead_e0;
+    byte_class[0xED] = dfa_lead_ed;
+    byte_class[0xF0] = dfa_lead_f0;
+    fill (byte_class + 0xF1, byte_class + 0xF4, dfa_lead4);
+    byte_class[0xF4] = dfa_lead_f4;
+
+    lead_payload[dfa_ascii] = 0x7F;
+    lead_payload[dfa_lead2] = 0x1F;
+    lead_payload[dfa_lead_e0] = lead_payload[dfa_lead3]
+      = lead_payload[dfa_lead_ed] = 0x0F;
+    lead_payload[dfa_lead_f0] = lead_payload[dfa_lead4]
+      = lead_payload[dfa_lead_f4] = 0x07;
+
+    for (auto &row : next)
+      fill (row, row + dfa_num_classes, dfa_reject);
+    auto &a = next[dfa_accept];
+    a[dfa_ascii] = dfa_accept;
+    a[dfa_lead2] = dfa_cont1;
+    a[dfa_lead_e0] = dfa_e0;
+    a[dfa_lead3] = dfa_cont2;
+    a[dfa_lead_ed] = dfa_ed;
+    a[dfa_lead_f0] = dfa_f0;
+    a[dfa_lead4] = dfa_cont3;
+    a[dfa_lead_f4] = dfa_f4;
+    for (auto c : {dfa_cont_80, dfa_cont_90, dfa_cont_a0})
+      {
+	next[dfa_cont1][c] = dfa_accept;
+	next[dfa_cont2][c] = dfa_cont1;
+	next[dfa_cont3][c] = dfa_cont2;
+      }
+    next[dfa_e0][dfa_cont_a0] = dfa_cont1;
+    next[dfa_ed][dfa_cont_80] = next[dfa_ed][dfa_cont_90] = dfa_cont1;
+    next[dfa_f0][dfa_cont_90] = next[dfa_f0][dfa_cont_a0] = dfa_cont2;
+    next[dfa_f4][dfa_cont_80] = dfa_cont2;
+  }
+};
+
+constexpr utf8_dfa_tables utf8_dfa;
+
+// Decodes with the DFA. A character outside of the BMP is written as a
+// surrogate pair if InternT is char16_t. The result is decided like in
+// utf8_decode_one: error as soon as a visible byte is invalid, partial if
+// the input ends inside of a character or there is no space for the next
+// one.
+template <class InternT>
+result
+utf8_dfa_decode (const unsigned char *&from, const unsigned char *from_end,
+		 InternT *&to, InternT *to_end)
+{
+  auto state = dfa_accept;
+  auto cp = char32_t ();
+  auto p = from;
+  for (; p != from_end; ++p)
+    {
+      if (state == dfa_accept && to == to_end)
+	break;
+      unsigned char b = *p;
+      auto cls = utf8_dfa.byte_class[b];
+      cp = state == dfa_accept ? b & utf8_dfa.lead_payload[cls]
+			       : (cp << 6) | (b & 0x3F);
+      state = utf8_dfa_state (utf8_dfa.next[state][cls]);
+      if (state == dfa_reject)
+	return codecvt_base::error;
+      if (state != dfa_accept)
+	continue;
+      if (sizeof (InternT) == 2 && cp >= 0x10000)
+	{
+	  if (to_end - to < 2)
+	    return codecvt_base::partial;
+	  cp -= 0x10000;
+	  *to++ = 0xD800 + (cp >> 10);
+	  *to++ = 0xDC00 + (cp & 0x3FF);
+	}
+      else
+	*to++ = cp;
+      from = p + 1;
+    }
+  if (p == from_end && state == dfa_accept)
+    return codecvt_base::ok;
+  return codecvt_base::partial;
+}
+
+#if UTF_KERNELS_X86
+
+// Shuffle tables for decoding up to four UTF-8 characters from 16 bytes.
+//
+// The table is indexed by bits 1 to 12 of the mask of continuation bytes of
+// the block, byte 0 being the leading byte of the first character. This is
+// enough to know the length of every character that ends before byte 12.
+// Each entry describes one shape, i.e. the sequence of lengths of the
+// decoded characters, with everything needed to decode and validate them in
+// four 32-bit lanes:
+//  - shuf moves the bytes of character k into lane k, the last byte of the
+//    character into the lowest byte of the lane,
+//  - the bits of hi_mask must be equal to pattern, which checks that the
+//    leading byte has the right length and that the others are continuation
+//    bytes,
+//  - the bits not in hi_mask are the payload,
+//  - min_value is the smallest non-overlong value of each lane.
+struct utf8_shape
+{
+  alignas (16) uint8_t shuf[16] = {};
+  alignas (16) uint8_t hi_mask[16] = {};
+  alignas (16) uint8_t pattern[16] = {};
+  alignas (16) uint32_t min_value[4] = {};
+};
+
+struct utf8_shape_index
+{
+  uint16_t shape = 0;
+  uint8_t consumed = 0; // bytes
+  uint8_t count = 0;	// characters, 0 if the first one is malformed
+};
+
+// 4 characters of length 1 to 4 give at most 4 + 16 + 64 + 256 shapes.
+const int max_utf8_shapes = 4 + 16 + 64 + 256 + 1;
+
+struct utf8_shape_tables
+{
+  utf8_shape shapes[max_utf8_shapes] = {};
+  utf8_shape_index index[4096] = {};
+
+  constexpr utf8_shape_tables ()
+  {
+    const uint8_t lead_mask[] = {0x80, 0xE0, 0xF0, 0xF8};
+    const uint8_t lead_pattern[] = {0x00, 0xC0, 0xE0, 0xF0};
+    const uint32_t min_value[] = {0, 0x80, 0x800, 0x10000};
+    // The shape with lengths l0..lk has the key offset[k + 1] plus the
+    // base-4 number with the digits l0 - 1 .. lk - 1.
+    const int key_offset[] = {0, 0, 4, 4 + 16, 4 + 16 + 64};
+    int shape_ids[max_utf8_shapes] = {};
+    int num_shapes = 1; // shape 0 decodes nothing
+    fill (shapes[0].shuf, shapes[0].shuf + 16, 0x80);
+
+    for (unsigned idx = 0; idx < 4096; ++idx)
+      {
+	auto cont_mask = idx << 1;
+	int pos = 0, count = 0, lengths[4], key = 0;
+	while (count < 4)
+	  {
+	    int len = 1;
+	    while (pos + len <= 12 && (cont_mask >> (pos + len) & 1))
+	      ++len;
+	    if (pos + len > 12 || len > 4)
+	      break;
+	    lengths[count++] = len;
+	    key = key * 4 + len - 1;
+	    pos += len;
+	  }
+	key += key_offset[count];
+	if (count != 0 && shape_ids[key] == 0)
+	  {
+	    auto &s = shapes[num_shapes];
+	    fill (s.shuf, s.shuf + 16, 0x80);
+	    for (int k = 0, start = 0; k < count; start += lengths[k++])
+	      {
+		auto len = lengths[k];
+		for (int j = 0; j < len; ++j)
+		  {
+		    s.shuf[4 * k + j] = start + len - 1 - j;
+		    s.hi_mask[4 * k + j] = j == len - 1 ? lead_mask[len - 1] : 0xC0;
+		    s.pattern[4 * k + j]
+		      = j == len - 1 ? lead_pattern[len - 1] : 0x80;
+		  }
+		s.min_value[k] = min_value[len - 1];
+	      }
+	    shape_ids[key] = num_shapes++;
+	  }
+	index[idx].shape = count ? shape_ids[key] : 0;
+	index[idx].consumed = pos;
+	index[idx].count = count;
+      }
+  }
+};
+
+constexpr utf8_shape_tables utf8_tables;
+
+// For every mask of lanes with a character outside of the BMP, moves the
+// 16-bit units of the four lanes together: one unit from a lane with a BMP
+// character and a surrogate pair from the others.
+struct utf16_compact_table
+{
+  alignas (16) uint8_t shuf[16][16] = {};
+
+  constexpr utf16_compact_table ()
+  {
+    for (auto &row : shuf)
+      fill (row, row + 16, 0x80);
+    for (int m = 0; m < 16; ++m)
+      for (int k = 0, j = 0; k < 4; ++k)
+	for (int w = 0; w < (m >> k & 1 ? 2 : 1); ++w, ++j)
+	  {
+	    shuf[m][2 * j] = 4 * k + 2 * w;
+	    shuf[m][2 * j + 1] = 4 * k + 2 * w + 1;
+	  }
+  }
+};
+
+constexpr utf16_compact_table utf16_compact;
+
+// For every combination of UTF-8 lengths of four characters, moves the
+// encoded bytes together. Lane k holds the 4-byte form of character k with
+// the last byte highest, the shorter forms end in the same byte. The index
+// has the length minus one of character k in bits 2k and 2k + 1.
+struct utf8_encode_table
+{
+  alignas (16) uint8_t shuf[256][16] = {};
+  uint8_t length[256] = {};
+
+  constexpr utf8_encode_table ()
+  {
+    for (auto &row : shuf)
+      fill (row, row + 16, 0x80);
+    for (int idx = 0; idx < 256; ++idx)
+      {
+	int pos = 0;
+	for (int k = 0; k < 4; ++k)
+	  {
+	    int len = (idx >> 2 * k & 3) + 1;
+	    for (int j = 4 - len; j < 4; ++j)
+	      shuf[idx][pos++] = 4 * k + j;
+	  }
+	length[idx] = pos;
+      }
+  }
+};
+
+constexpr utf8_encode_table utf8_encode;
+
+// For every mask of 16-bit lanes with a character of 2 bytes, moves the
+// UTF-8 bytes of eight characters below U+0800 together. Lane k holds the
+// 2-byte form of character k, or the 1-byte form in its high byte.
+struct utf8_encode2_table
+{
+  alignas (16) uint8_t shuf[256][16] = {};
+  uint8_t length[256] = {};
+
+  constexpr utf8_encode2_table ()
+  {
+    for (auto &row : shuf)
+      fill (row, row + 16, 0x80);
+    for (int m = 0; m < 256; ++m)
+      {
+	int pos = 0;
+	for (int k = 0; k < 8; ++k)
+	  {
+	    if (m >> k & 1)
+	      shuf[m][pos++] = 2 * k;
+	    shuf[m][pos++] = 2 * k + 1;
+	  }
+	length[m] = pos;
+      }
+  }
+};
+
+constexpr utf8_encode2_table utf8_encode2;
+
+// Spreads the bits of a 4-bit lane mask to the even bits of a byte.
+const uint8_t spread_lane_bits[16]
+  = {0x00, 0x01, 0x04, 0x05, 0x10, 0x11, 0x14, 0x15,
+     0x40, 0x41, 0x44, 0x45, 0x50, 0x51, 0x54, 0x55};
+
+// Decodes and validates up to four characters that start at from, one per
+// 32-bit lane of v, unused lanes being zero. Needs 16 readable bytes at from.
+// Returns null if any of the characters is malformed or the first one is not
+// complete in the first 13 bytes.
+SIMD_TARGET ("sse4.2")
+inline const utf8_shape_index *
+utf8_decode4_sse42 (const unsigned char *from, __m128i &v)
+{
+  auto in = _mm_loadu_si128 ((const __m128i *) from);
+  // bytes 0x80 - 0xBF are -128 to -65 as signed bytes
+  auto cont = _mm_cmplt_epi8 (in, _mm_set1_epi8 (-64));
+  auto cont_bits = unsigned (_mm_movemask_epi8 (cont));
+  auto &ix = utf8_tables.index[(cont_bits >> 1) & 0xFFF];
+  if (ix.count == 0)
+    return nullptr;
+  auto &s = utf8_tables.shapes[ix.shape];
+  auto perm = _mm_shuffle_epi8 (in, _mm_load_si128 ((const __m128i *) s.shuf));
+  auto hi_mask = _mm_load_si128 ((const __m128i *) s.hi_mask);
+  auto pattern = _mm_load_si128 ((const __m128i *) s.pattern);
+  auto bad = _mm_xor_si128 (_mm_cmpeq_epi8 (_mm_and_si128 (perm, hi_mask),
+					    pattern),
+			    _mm_set1_epi8 (-1));
+
+  auto p = _mm_andnot_si128 (hi_mask, perm);
+  auto b0 = _mm_and_si128 (p, _mm_set1_epi32 (0xFF));
+  auto b1 = _mm_srli_epi32 (_mm_and_si128 (p, _mm_set1_epi32 (0xFF00)), 2);
+  auto b2 = _mm_srli_epi32 (_mm_and_si128 (p, _mm_set1_epi32 (0xFF0000)), 4);
+  auto b3 = _mm_and_si128 (_mm_srli_epi32 (p, 6), _mm_set1_epi32 (0x1C0000));
+  v = _mm_or_si128 (_mm_or_si128 (b0, b1), _mm_or_si128 (b2, b3));
+
+  auto min_value = _mm_load_si128 ((const __m128i *) s.min_value);
+  bad = _mm_or_si128 (bad, _mm_cmplt_epi32 (v, min_value));
+  bad = _mm_or_si128 (bad, _mm_cmpgt_epi32 (v, _mm_set1_epi32 (0x10FFFF)));
+  auto surr = _mm_and_si128 (v, _mm_set1_epi32 (0xFFFFF800));
+  bad = _mm_or_si128 (bad, _mm_cmpeq_epi32 (surr, _mm_set1_epi32 (0xD800)));
+  if (!_mm_testz_si128 (bad, bad))
+    return nullptr;
+  return &ix;
+}
+
+// Needs space for 4 characters at to.
+SIMD_TARGET ("sse4.2")
+inline bool
+utf8_to_utf32_step_sse42 (const unsigned char *&from, char32_t *&to)
+{
+  auto v = __m128i ();
+  auto ix = utf8_decode4_sse42 (from, v);
+  if (!ix)
+    return false;
+  _mm_storeu_si128 ((__m128i *) to, v);
+  from += ix->consumed;
+  to += ix->count;
+  return true;
+}
+
+// Needs space for 8 units at to.
+SIMD_TARGET ("sse4.2")
+inline bool
+utf8_to_utf16_step_sse42 (const unsigned char *&from, char16_t *&to)
+{
+  auto v = __m128i ();
+  auto ix = utf8_decode4_sse42 (from, v);
+  if (!ix)
+    return false;
+  auto supp = _mm_cmpgt_epi32 (v, _mm_set1_epi32 (0xFFFF));
+  auto supp_bits = _mm_movemask_ps (_mm_castsi128_ps (supp));
+  if (supp_bits == 0)
+    {
+      _mm_storel_epi64 ((__m128i *) to, _mm_packus_epi32 (v, v));
+      to += ix->count;
+    }
+  else
+    {
+      auto c = _mm_sub_epi32 (v, _mm_set1_epi32 (0x10000));
+      auto hi = _mm_add_epi32 (_mm_srli_epi32 (c, 10), _mm_set1_epi32 (0xD800));
+      auto lo = _mm_or_si128 (_mm_and_si128 (c, _mm_set1_epi32 (0x3FF)),
+			      _mm_set1_epi32 (0xDC00));
+      auto pair = _mm_or_si128 (hi, _mm_slli_epi32 (lo, 16));
+      auto units = _mm_blendv_epi8 (v, pair, supp);
+      auto shuf = _mm_load_si128 ((const __m128i *) utf16_compact.shuf[supp_bits]);
+      _mm_storeu_si128 ((__m128i *) to, _mm_shuffle_epi8 (units, shuf));
+      to += ix->count + __builtin_popcount (supp_bits);
+    }
+  from += ix->consumed;
+  return true;
+}
+
+// The UTF-8 form of the characters in the 32-bit lanes of v, below
+// U+110000, the last byte of each one being the highest byte of its lane.
+SIMD_TARGET ("sse4.2")
+inline __m128i
+utf8_bytes4_sse42 (__m128i v)
+{
+  auto ge_80 = _mm_cmpgt_epi32 (v, _mm_set1_epi32 (0x7F));
+  auto ge_800 = _mm_cmpgt_epi32 (v, _mm_set1_epi32 (0x7FF));
+  auto ge_10000 = _mm_cmpgt_epi32 (v, _mm_set1_epi32 (0xFFFF));
+
+  // The 4-byte form, lead byte in the lowest byte. The lead byte of the
+  // 3-byte form is the second byte with 0x60 added, and the lead byte of the
+  // 2-byte form is the third byte with 0x40 added.
+  auto b0 = _mm_srli_epi32 (v, 18);
+  auto b1 = _mm_srli_epi32 (_mm_and_si128 (v, _mm_set1_epi32 (0x3F000)), 4);
+  auto b2 = _mm_slli_epi32 (_mm_and_si128 (v, _mm_set1_epi32 (0xFC0)), 10);
+  auto b3 = _mm_slli_epi32 (_mm_and_si128 (v, _mm_set1_epi32 (0x3F)), 24);
+  auto bytes = _mm_or_si128 (_mm_or_si128 (b0, b1), _mm_or_si128 (b2, b3));
+  bytes = _mm_or_si128 (bytes, _mm_set1_epi32 (0x808080F0));
+  auto lead3 = _mm_and_si128 (_mm_andnot_si128 (ge_10000, ge_800),
+			      _mm_set1_epi32 (0x6000));
+  auto lead2 = _mm_and_si128 (_mm_andnot_si128 (ge_800, ge_80),
+			      _mm_set1_epi32 (0x400000));
+  bytes = _mm_or_si128 (bytes, _mm_or_si128 (lead3, lead2));
+  return _mm_blendv_epi8 (_mm_slli_epi32 (v, 24), bytes, ge_80);
+}
+
+// Encodes the four characters in the 32-bit lanes of v. Needs space for 16
+// bytes at to. Returns false and writes nothing if one of them is a
+// surrogate or above U+10FFFF.
+SIMD_TARGET ("sse4.2")
+inline bool
+utf8_encode4_sse42 (__m128i v, unsigned char *&to)
+{
+  auto above = _mm_cmpgt_epi32 (_mm_srli_epi32 (v, 16), _mm_set1_epi32 (0x10));
+  auto surr = _mm_cmpeq_epi32 (_mm_and_si128 (v, _mm_set1_epi32 (0xFFFFF800)),
+			       _mm_set1_epi32 (0xD800));
+  auto bad = _mm_or_si128 (above, surr);
+  if (!_mm_testz_si128 (bad, bad))
+    return false;
+
+  // all values are below 0x110000, so signed compares are fine
+  auto ge_80 = _mm_cmpgt_epi32 (v, _mm_set1_epi32 (0x7F));
+  auto ge_800 = _mm_cmpgt_epi32 (v, _mm_set1_epi32 (0x7FF));
+  auto ge_10000 = _mm_cmpgt_epi32 (v, _mm_set1_epi32 (0xFFFF));
+  auto idx = spread_lane_bits[_mm_movemask_ps (_mm_castsi128_ps (ge_80))]
+	     + spread_lane_bits[_mm_movemask_ps (_mm_castsi128_ps (ge_800))]
+	     + spread_lane_bits[_mm_movemask_ps (_mm_castsi128_ps (ge_10000))];
+  auto shuf = _mm_load_si128 ((const __m128i *) utf8_encode.shuf[idx]);
+  _mm_storeu_si128 ((__m128i *) to,
+		    _mm_shuffle_epi8 (utf8_bytes4_sse42 (v), shuf));
+  to += utf8_encode.length[idx];
+  return true;
+}
+
+// Encodes the UTF-16 code units in the 32-bit lanes of u, prev and next
+// being the units before and after each of them. A high surrogate gives the
+// first two bytes of the character of its pair and the low surrogate gives
+// the last two. hi and lo are the masks of such lanes, the pairs must be
+// valid. Needs space for 16 bytes at to, returns the number of bytes.
+SIMD_TARGET ("sse4.2")
+inline int
+utf16_encode4_sse42 (__m128i u, __m128i prev, __m128i next, __m128i hi,
+		     __m128i lo, unsigned char *to)
+{
+  auto bias = _mm_set1_epi32 (0x10000 - (0xD800 << 10) - 0xDC00);
+  auto pair_hi
+    = _mm_add_epi32 (_mm_add_epi32 (_mm_slli_epi32 (u, 10), next), bias);
+  auto pair_lo
+    = _mm_add_epi32 (_mm_add_epi32 (_mm_slli_epi32 (prev, 10), u), bias);
+  auto v = _mm_blendv_epi8 (_mm_blendv_epi8 (u, pair_lo, lo), pair_hi, hi);
+  auto bytes = utf8_bytes4_sse42 (v);
+  // the first two bytes of the 4-byte form go to the top of the lane
+  bytes = _mm_blendv_epi8 (bytes, _mm_slli_epi32 (bytes, 16), hi);
+
+  auto surr = _mm_or_si128 (hi, lo);
+  auto ge_80 = _mm_cmpgt_epi32 (v, _mm_set1_epi32 (0x7F));
+  auto ge_800 = _mm_andnot_si128 (surr,
+				  _mm_cmpgt_epi32 (v, _mm_set1_epi32 (0x7FF)));
+  auto idx = spread_lane_bits[_mm_movemask_ps (_mm_castsi128_ps (ge_80))]
+	     + spread_lane_bits[_mm_movemask_ps (_mm_castsi128_ps (ge_800))];
+  auto shuf = _mm_load_si128 ((const __m128i *) utf8_encode.shuf[idx]);
+  _mm_storeu_si128 ((__m128i *) to, _mm_shuffle_epi8 (bytes, shuf));
+  return utf8_encode.length[idx];
+}
+
+// Encodes eight UTF-16 code units, or seven if the last one is a high
+// surrogate. Needs space for 32 bytes at to. Returns false and writes
+// nothing if there is a lone surrogate.
+SIMD_TARGET ("sse4.2")
+inline bool
+utf16_to_utf8_step_sse42 (const char16_t *&from, unsigned char *&to)
+{
+  auto in = _mm_loadu_si128 ((const __m128i *) from);
+  auto top = _mm_and_si128 (in, _mm_set1_epi16 (-0x400)); // 0xFC00
+  auto hi = _mm_cmpeq_epi16 (top, _mm_set1_epi16 (-0x2800)); // 0xD800
+  auto lo = _mm_cmpeq_epi16 (top, _mm_set1_epi16 (-0x2400)); // 0xDC00
+  auto lone_hi = _mm_andnot_si128 (_mm_srli_si128 (lo, 2), hi);
+  auto lone_lo = _mm_andnot_si128 (_mm_slli_si128 (hi, 2), lo);
+  // a high surrogate in the last lane is left for the next step
+  lone_hi = _mm_and_si128 (lone_hi, _mm_srli_si128 (_mm_set1_epi8 (-1), 2));
+  if (_mm_movemask_epi8 (_mm_or_si128 (lone_hi, lone_lo)) != 0)
+    return false;
+  auto last_hi = _mm_extract_epi16 (hi, 7) != 0;
+
+  auto below_800
+    = _mm_cmpeq_epi16 (_mm_and_si128 (in, _mm_set1_epi16 (-0x800)),
+		       _mm_setzero_si128 ());
+  if (_mm_movemask_epi8 (below_800) == 0xFFFF)
+    {
+      // Latin, Greek, Cyrillic, Hebrew, Arabic..., 1 or 2 bytes each
+      auto ge_80 = _mm_xor_si128 (
+	_mm_cmpeq_epi16 (_mm_and_si128 (in, _mm_set1_epi16 (-0x80)),
+			 _mm_setzero_si128 ()),
+	_mm_set1_epi8 (-1));
+      auto lead = _mm_or_si128 (_mm_srli_epi16 (in, 6), _mm_set1_epi16 (0xC0));
+      auto cont = _mm_or_si128 (_mm_and_si128 (in, _mm_set1_epi16 (0x3F)),
+				_mm_set1_epi16 (0x80));
+      auto two = _mm_or_si128 (lead, _mm_slli_epi16 (cont, 8));
+      auto bytes = _mm_blendv_epi8 (_mm_slli_epi16 (in, 8), two, ge_80);
+      auto m = _mm_movemask_epi8 (_mm_packs_epi16 (ge_80, ge_80)) & 0xFF;
+      auto shuf = _mm_load_si128 ((const __m128i *) utf8_encode2.shuf[m]);
+      _mm_storeu_si128 ((__m128i *) to, _mm_shuffle_epi8 (bytes, shuf));
+      to += utf8_encode2.length[m];
+      from += 8;
+      return true;
+    }
+
+  // the rest, up to 3 bytes per unit
+  auto zero = _mm_setzero_si128 ();
+  auto prev = _mm_slli_si128 (in, 2);
+  auto next = _mm_srli_si128 (in, 2);
+  to += utf16_encode4_sse42 (
+    _mm_unpacklo_epi16 (in, zero), _mm_unpacklo_epi16 (prev, zero),
+    _mm_unpacklo_epi16 (next, zero), _mm_unpacklo_epi16 (hi, hi),
+    _mm_unpacklo_epi16 (lo, lo), to);
+  to += utf16_encode4_sse42 (
+    _mm_unpackhi_epi16 (in, zero), _mm_unpackhi_epi16 (prev, zero),
+    _mm_unpackhi_epi16 (next, zero), _mm_unpackhi_epi16 (hi, hi),
+    _mm_unpackhi_epi16 (lo, lo), to);
+  // the bytes of the last high surrogate are at the end
+  to -= last_hi ? 2 : 0;
+  from += last_hi ? 7 : 8;
+  return true;
+}
+
+SIMD_TARGET ("sse4.2")
+result
+utf8_to_utf32_sse42 (const unsigned char *&from,
+		     const unsigned char *from_end, char32_t *&to,
+		     char32_t *to_end)
+{
+  auto zero = _mm_setzero_si128 ();
+  while (from != from_end)
+    {
+      // ASCII fast path, 16 characters at a time
+      while (from_end - from >= 16 && to_end - to >= 16)
+	{
+	  auto in = _mm_loadu_si128 ((const __m128i *) from);
+	  if (_mm_movemask_epi8 (in) != 0)
+	    break;
+	  auto lo = _mm_unpacklo_epi8 (in, zero);
+	  auto hi = _mm_unpackhi_epi8 (in, zero);
+	  auto out = (__m128i *) to;
+	  _mm_storeu_si128 (out + 0, _mm_unpacklo_epi16 (lo, zero));
+	  _mm_storeu_si128 (out + 1, _mm_unpackhi_epi16 (lo, zero));
+	  _mm_storeu_si128 (out + 2, _mm_unpacklo_epi16 (hi, zero));
+	  _mm_storeu_si128 (out + 3, _mm_unpackhi_epi16 (hi, zero));
+	  from += 16;
+	  to += 16;
+	}
+      // 2-, 3- and 4-byte characters, up to 4 at a time
+      while (from_end - from >= 16 && to_end - to >= 4
+	     && utf8_to_utf32_step_sse42 (from, to))
+	if (from_end - from >= 16 && to_end - to >= 16 && *from < 0x80)
+	  break;
+      if (from == from_end)
+	break;
+      if (to == to_end)
+	return codecvt_base::partial;
+      auto res = utf8_to_utf32_one (from, from_end, to);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+SIMD_TARGET ("avx2")
+result
+utf8_to_utf32_avx2 (const unsigned char *&from, const unsigned char *from_end,
+		    char32_t *&to, char32_t *to_end)
+{
+  while (from != from_end)
+    {
+      // ASCII fast path, 32 characters at a time
+      while (from_end - from >= 32 && to_end - to >= 32)
+	{
+	  auto in = _mm256_loadu_si256 ((const __m256i *) from);
+	  if (_mm256_movemask_epi8 (in) != 0)
+	    break;
+	  auto lo = _mm256_castsi256_si128 (in);
+	  auto hi = _mm256_extracti128_si256 (in, 1);
+	  auto out = (__m256i *) to;
+	  _mm256_storeu_si256 (out + 0, _mm256_cvtepu8_epi32 (lo));
+	  _mm256_storeu_si256 (out + 1,
+			       _mm256_cvtepu8_epi32 (_mm_srli_si128 (lo, 8)));
+	  _mm256_storeu_si256 (out + 2, _mm256_cvtepu8_epi32 (hi));
+	  _mm256_storeu_si256 (out + 3,
+			       _mm256_cvtepu8_epi32 (_mm_srli_si128 (hi, 8)));
+	  from += 32;
+	  to += 32;
+	}
+      // 2-, 3- and 4-byte characters, up to 4 at a time
+      while (from_end - from >= 16 && to_end - to >= 4
+	     && utf8_to_utf32_step_sse42 (from, to))
+	if (from_end - from >= 32 && to_end - to >= 32 && *from < 0x80)
+	  break;
+      if (from == from_end)
+	break;
+      if (to == to_end)
+	return codecvt_base::partial;
+      auto res = utf8_to_utf32_one (from, from_end, to);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+SIMD_TARGET ("sse4.2")
+result
+utf32_to_utf8_sse42 (const char32_t *&from, const char32_t *from_end,
+		     unsigned char *&to, unsigned char *to_end)
+{
+  while (from != from_end)
+    {
+      // ASCII fast path, 16 characters at a time
+      while (from_end - from >= 16 && to_end - to >= 16)
+	{
+	  auto in = (const __m128i *) from;
+	  auto in0 = _mm_loadu_si128 (in + 0);
+	  auto in1 = _mm_loadu_si128 (in + 1);
+	  auto in2 = _mm_loadu_si128 (in + 2);
+	  auto in3 = _mm_loadu_si128 (in + 3);
+	  auto any = _mm_or_si128 (_mm_or_si128 (in0, in1),
+				   _mm_or_si128 (in2, in3));
+	  auto non_ascii = _mm_and_si128 (any, _mm_set1_epi32 (-0x80));
+	  if (_mm_movemask_epi8 (_mm_cmpeq_epi32 (non_ascii,
+						  _mm_setzero_si128 ()))
+	      != 0xFFFF)
+	    break;
+	  auto lo = _mm_packs_epi32 (in0, in1);
+	  auto hi = _mm_packs_epi32 (in2, in3);
+	  _mm_storeu_si128 ((__m128i *) to, _mm_packus_epi16 (lo, hi));
+	  from += 16;
+	  to += 16;
+	}
+      // characters of any length, 4 at a time
+      while (from_end - from >= 4 && to_end - to >= 16
+	     && utf8_encode4_sse42 (_mm_loadu_si128 ((const __m128i *) from),
+				    to))
+	{
+	  from += 4;
+	  if (from_end - from >= 16 && to_end - to >= 16 && *from < 0x80)
+	    break;
+	}
+      if (from == from_end)
+	break;
+      auto res = utf8_encode_one (*from, to, to_end);
+      if (res != codecvt_base::ok)
+	return res;
+      ++from;
+    }
+  return codecvt_base::ok;
+}
+
+SIMD_TARGET ("avx2")
+result
+utf32_to_utf8_avx2 (const char32_t *&from, const char32_t *from_end,
+		    unsigned char *&to, unsigned char *to_end)
+{
+  while (from != from_end)
+    {
+      // ASCII fast path, 32 characters at a time
+      while (from_end - from >= 32 && to_end - to >= 32)
+	{
+	  auto in = (const __m256i *) from;
+	  auto in0 = _mm256_loadu_si256 (in + 0);
+	  auto in1 = _mm256_loadu_si256 (in + 1);
+	  auto in2 = _mm256_loadu_si256 (in + 2);
+	  auto in3 = _mm256_loadu_si256 (in + 3);
+	  auto any = _mm256_or_si256 (_mm256_or_si256 (in0, in1),
+				      _mm256_or_si256 (in2, in3));
+	  auto non_ascii = _mm256_and_si256 (any, _mm256_set1_epi32 (-0x80));
+	  if (!_mm256_testz_si256 (non_ascii, non_ascii))
+	    break;
+	  // the packs work within 128-bit lanes, so the 32-bit groups of
+	  // four characters come out in the order 0 2 4 6 1 3 5 7
+	  auto lo = _mm256_packs_epi32 (in0, in1);
+	  auto hi = _mm256_packs_epi32 (in2, in3);
+	  auto packed = _mm256_packus_epi16 (lo, hi);
+	  packed = _mm256_permutevar8x32_epi32 (
+	    packed, _mm256_setr_epi32 (0, 4, 1, 5, 2, 6, 3, 7));
+	  _mm256_storeu_si256 ((__m256i *) to, packed);
+	  from += 32;
+	  to += 32;
+	}
+      // characters of any length, 4 at a time
+      while (from_end - from >= 4 && to_end - to >= 16
+	     && utf8_encode4_sse42 (_mm_loadu_si128 ((const __m128i *) from),
+				    to))
+	{
+	  from += 4;
+	  if (from_end - from >= 32 && to_end - to >= 32 && *from < 0x80)
+	    break;
+	}
+      if (from == from_end)
+	break;
+      auto res = utf8_encode_one (*from, to, to_end);
+      if (res != codecvt_base::ok)
+	return res;
+      ++from;
+    }
+  return codecvt_base::ok;
+}
+
+SIMD_TARGET ("sse4.2")
+result
+utf8_to_utf16_sse42 (const unsigned char *&from,
+		     const unsigned char *from_end, char16_t *&to,
+		     char16_t *to_end)
+{
+  auto zero = _mm_setzero_si128 ();
+  while (from != from_end)
+    {
+      // ASCII fast path, 16 characters at a time
+      while (from_end - from >= 16 && to_end - to >= 16)
+	{
+	  auto in = _mm_loadu_si128 ((const __m128i *) from);
+	  if (_mm_movemask_epi8 (in) != 0)
+	    break;
+	  auto out = (__m128i *) to;
+	  _mm_storeu_si128 (out + 0, _mm_unpacklo_epi8 (in, zero));
+	  _mm_storeu_si128 (out + 1, _mm_unpackhi_epi8 (in, zero));
+	  from += 16;
+	  to += 16;
+	}
+      // 2-, 3- and 4-byte characters, up to 4 at a time
+      while (from_end - from >= 16 && to_end - to >= 8
+	     && utf8_to_utf16_step_sse42 (from, to))
+	if (from_end - from >= 16 && to_end - to >= 16 && *from < 0x80)
+	  break;
+      if (from == from_end)
+	break;
+      if (to == to_end)
+	return codecvt_base::partial;
+      auto res = utf8_to_utf16_one (from, from_end, to, to_end);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+SIMD_TARGET ("sse4.2")
+result
+utf16_to_utf8_sse42 (const char16_t *&from, const char16_t *from_end,
+		     unsigned char *&to, unsigned char *to_end)
+{
+  while (from != from_end)
+    {
+      // ASCII fast path, 16 characters at a time
+      while (from_end - from >= 16 && to_end - to >= 16)
+	{
+	  auto in0 = _mm_loadu_si128 ((const __m128i *) from);
+	  auto in1 = _mm_loadu_si128 ((const __m128i *) from + 1);
+	  auto non_ascii
+	    = _mm_and_si128 (_mm_or_si128 (in0, in1), _mm_set1_epi16 (-0x80));
+	  if (_mm_movemask_epi8 (_mm_cmpeq_epi16 (non_ascii,
+						  _mm_setzero_si128 ()))
+	      != 0xFFFF)
+	    break;
+	  _mm_storeu_si128 ((__m128i *) to, _mm_packus_epi16 (in0, in1));
+	  from += 16;
+	  to += 16;
+	}
+      // everything else, 8 units at a time
+      while (from_end - from >= 8 && to_end - to >= 32
+	     && utf16_to_utf8_step_sse42 (from, to))
+	if (from_end - from >= 16 && to_end - to >= 16 && *from < 0x80)
+	  break;
+      if (from == from_end)
+	break;
+      auto res = utf16_to_utf8_one (from, from_end, to, to_end);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+SIMD_TARGET ("avx2")
+result
+utf8_to_utf16_avx2 (const unsigned char *&from, const unsigned char *from_end,
+		    char16_t *&to, char16_t *to_end)
+{
+  while (from != from_end)
+    {
+      // ASCII fast path, 32 characters at a time
+      while (from_end - from >= 32 && to_end - to >= 32)
+	{
+	  auto in = _mm256_loadu_si256 ((const __m256i *) from);
+	  if (_mm256_movemask_epi8 (in) != 0)
+	    break;
+	  auto out = (__m256i *) to;
+	  _mm256_storeu_si256 (out + 0, _mm256_cvtepu8_epi16 (
+					  _mm256_castsi256_si128 (in)));
+	  _mm256_storeu_si256 (out + 1, _mm256_cvtepu8_epi16 (
+					  _mm256_extracti128_si256 (in, 1)));
+	  from += 32;
+	  to += 32;
+	}
+      // 2-, 3- and 4-byte characters, up to 4 at a time
+      while (from_end - from >= 16 && to_end - to >= 8
+	     && utf8_to_utf16_step_sse42 (from, to))
+	if (from_end - from >= 32 && to_end - to >= 32 && *from < 0x80)
+	  break;
+      if (from == from_end)
+	break;
+      if (to == to_end)
+	return codecvt_base::partial;
+      auto res = utf8_to_utf16_one (from, from_end, to, to_end);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+SIMD_TARGET ("avx2")
+result
+utf16_to_utf8_avx2 (const char16_t *&from, const char16_t *from_end,
+		    unsigned char *&to, unsigned char *to_end)
+{
+  while (from != from_end)
+    {
+      // ASCII fast path, 32 characters at a time
+      while (from_end - from >= 32 && to_end - to >= 32)
+	{
+	  auto in0 = _mm256_loadu_si256 ((const __m256i *) from);
+	  auto in1 = _mm256_loadu_si256 ((const __m256i *) from + 1);
+	  auto non_ascii = _mm256_and_si256 (_mm256_or_si256 (in0, in1),
+					     _mm256_set1_epi16 (-0x80));
+	  if (!_mm256_testz_si256 (non_ascii, non_ascii))
+	    break;
+	  // packus works within 128-bit lanes, so the result is in the
+	  // order 0 2 1 3 of 64-bit quarters
+	  auto packed = _mm256_packus_epi16 (in0, in1);
+	  packed = _mm256_permute4x64_epi64 (packed, 0xD8);
+	  _mm256_storeu_si256 ((__m256i *) to, packed);
+	  from += 32;
+	  to += 32;
+	}
+      // everything else, 8 units at a time
+      while (from_end - from >= 8 && to_end - to >= 32
+	     && utf16_to_utf8_step_sse42 (from, to))
+	if (from_end - from >= 32 && to_end - to >= 32 && *from < 0x80)
+	  break;
+      if (from == from_end)
+	break;
+      auto res = utf16_to_utf8_one (from, from_end, to, to_end);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+// The AVX-512 kernels have wider ASCII paths and share the other steps with
+// the AVX2 ones. Only the kernels between UTF-8 and UTF-32 or UTF-16 have
+// them, the UTF-16 byte order kernels of this level are the AVX2 ones.
+SIMD_TARGET ("avx512f,avx512bw")
+result
+utf8_to_utf32_avx512 (const unsigned char *&from,
+		      const unsigned char *from_end, char32_t *&to,
+		      char32_t *to_end)
+{
+  while (from != from_end)
+    {
+      // ASCII fast path, 64 characters at a time
+      while (from_end - from >= 64 && to_end - to >= 64)
+	{
+	  auto in = _mm512_loadu_si512 (from);
+	  if (_mm512_movepi8_mask (in) != 0)
+	    break;
+	  auto out = (__m512i *) to;
+	  for (int i = 0; i < 4; ++i)
+	    _mm512_storeu_si512 (out + i,
+				 _mm512_cvtepu8_epi32 (_mm_loadu_si128 (
+				   (const __m128i *) from + i)));
+	  from += 64;
+	  to += 64;
+	}
+      // 2-, 3- and 4-byte characters, up to 4 at a time
+      while (from_end - from >= 16 && to_end - to >= 4
+	     && utf8_to_utf32_step_sse42 (from, to))
+	if (from_end - from >= 64 && to_end - to >= 64 && *from < 0x80)
+	  break;
+      if (from == from_end)
+	break;
+      if (to == to_end)
+	return codecvt_base::partial;
+      auto res = utf8_to_utf32_one (from, from_end, to);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+SIMD_TARGET ("avx512f,avx512bw")
+result
+utf32_to_utf8_avx512 (const char32_t *&from, const char32_t *from_end,
+		      unsigned char *&to, unsigned char *to_end)
+{
+  while (from != from_end)
+    {
+      // ASCII fast path, 64 characters at a time
+      while (from_end - from >= 64 && to_end - to >= 64)
+	{
+	  auto in = (const __m512i *) from;
+	  auto in0 = _mm512_loadu_si512 (in + 0);
+	  auto in1 = _mm512_loadu_si512 (in + 1);
+	  auto in2 = _mm512_loadu_si512 (in + 2);
+	  auto in3 = _mm512_loadu_si512 (in + 3);
+	  auto any = _mm512_or_si512 (_mm512_or_si512 (in0, in1),
+				      _mm512_or_si512 (in2, in3));
+	  if (_mm512_test_epi32_mask (any, _mm512_set1_epi32 (-0x80)) != 0)
+	    break;
+	  auto out = (__m128i *) to;
+	  _mm_storeu_si128 (out + 0, _mm512_cvtepi32_epi8 (in0));
+	  _mm_storeu_si128 (out + 1, _mm512_cvtepi32_epi8 (in1));
+	  _mm_storeu_si128 (out + 2, _mm512_cvtepi32_epi8 (in2));
+	  _mm_storeu_si128 (out + 3, _mm512_cvtepi32_epi8 (in3));
+	  from += 64;
+	  to += 64;
+	}
+      // characters of any length, 4 at a time
+      while (from_end - from >= 4 && to_end - to >= 16
+	     && utf8_encode4_sse42 (_mm_loadu_si128 ((const __m128i *) from),
+				    to))
+	{
+	  from += 4;
+	  if (from_end - from >= 64 && to_end - to >= 64 && *from < 0x80)
+	    break;
+	}
+      if (from == from_end)
+	break;
+      auto res = utf8_encode_one (*from, to, to_end);
+      if (res != codecvt_base::ok)
+	return res;
+      ++from;
+    }
+  return codecvt_base::ok;
+}
+
+SIMD_TARGET ("avx512f,avx512bw")
+result
+utf8_to_utf16_avx512 (const unsigned char *&from,
+		      const unsigned char *from_end, char16_t *&to,
+		      char16_t *to_end)
+{
+  while (from != from_end)
+    {
+      // ASCII fast path, 64 characters at a time
+      while (from_end - from >= 64 && to_end - to >= 64)
+	{
+	  auto in = _mm512_loadu_si512 (from);
+	  if (_mm512_movepi8_mask (in) != 0)
+	    break;
+	  auto out = (__m512i *) to;
+	  _mm512_storeu_si512 (out + 0, _mm512_cvtepu8_epi16 (
+					  _mm512_castsi512_si256 (in)));
+	  _mm512_storeu_si512 (out + 1, _mm512_cvtepu8_epi16 (
+					  _mm512_extracti64x4_epi64 (in, 1)));
+	  from += 64;
+	  to += 64;
+	}
+      // 2-, 3- and 4-byte characters, up to 4 at a time
+      while (from_end - from >= 16 && to_end - to >= 8
+	     && utf8_to_utf16_step_sse42 (from, to))
+	if (from_end - from >= 64 && to_end - to >= 64 && *from < 0x80)
+	  break;
+      if (from == from_end)
+	break;
+      if (to == to_end)
+	return codecvt_base::partial;
+      auto res = utf8_to_utf16_one (from, from_end, to, to_end);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+SIMD_TARGET ("avx512f,avx512bw")
+result
+utf16_to_utf8_avx512 (const char16_t *&from, const char16_t *from_end,
+		      unsigned char *&to, unsigned char *to_end)
+{
+  while (from != from_end)
+    {
+      // ASCII fast path, 64 characters at a time
+      while (from_end - from >= 64 && to_end - to >= 64)
+	{
+	  auto in0 = _mm512_loadu_si512 (from);
+	  auto in1 = _mm512_loadu_si512 (from + 32);
+	  if (_mm512_test_epi16_mask (_mm512_or_si512 (in0, in1),
+				      _mm512_set1_epi16 (-0x80))
+	      != 0)
+	    break;
+	  auto out = (__m256i *) to;
+	  _mm256_storeu_si256 (out + 0, _mm512_cvtepi16_epi8 (in0));
+	  _mm256_storeu_si256 (out + 1, _mm512_cvtepi16_epi8 (in1));
+	  from += 64;
+	  to += 64;
+	}
+      // everything else, 8 units at a time
+      while (from_end - from >= 8 && to_end - to >= 32
+	     && utf16_to_utf8_step_sse42 (from, to))
+	if (from_end - from >= 64 && to_end - to >= 64 && *from < 0x80)
+	  break;
+      if (from == from_end)
+	break;
+      auto res = utf16_to_utf8_one (from, from_end, to, to_end);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+// The UTF-16 kernels below convert one block at a time. Surrogates are
+// detected in the vector. A block is converted up to its first surrogate
+// code unit, or its first character that can not be a single unit, and the
+// scalar code takes that character.
+
+// Swaps the bytes of every 16-bit lane if the data is big endian.
+SIMD_TARGET ("sse2")
+inline __m128i
+utf16_swap_sse2 (__m128i x, bool little_endian)
+{
+  if (little_endian)
+    return x;
+  return _mm_or_si128 (_mm_slli_epi16 (x, 8), _mm_srli_epi16 (x, 8));
+}
+
+// Index of the first 16-bit lane set in a compare mask, 8 if none.
+inline int
+first_unit (unsigned mask)
+{
+  return mask ? __builtin_ctz (mask) / 2 : 8;
+}
+
+SIMD_TARGET ("sse2")
+inline __m128i
+utf16_surrogates_sse2 (__m128i units)
+{
+  return _mm_cmpeq_epi16 (_mm_and_si128 (units, _mm_set1_epi16 (-0x800)),
+			  _mm_set1_epi16 (-0x2800)); // 0xF800 and 0xD800
+}
+
+SIMD_TARGET ("sse2")
+result
+utf16_bytes_to_utf32_sse2 (const unsigned char *&from,
+			   const unsigned char *from_end, char32_t *&to,
+			   char32_t *to_end, bool little_endian)
+{
+  auto zero = _mm_setzero_si128 ();
+  while (from != from_end)
+    {
+      while (from_end - from >= 16 && to_end - to >= 8)
+	{
+	  auto x = utf16_swap_sse2 (_mm_loadu_si128 ((const __m128i *) from),
+				    little_endian);
+	  auto n = first_unit (
+	    _mm_movemask_epi8 (utf16_surrogates_sse2 (x)));
+	  _mm_storeu_si128 ((__m128i *) to, _mm_unpacklo_epi16 (x, zero));
+	  _mm_storeu_si128 ((__m128i *) to + 1, _mm_unpackhi_epi16 (x, zero));
+	  from += 2 * n;
+	  to += n;
+	  if (n != 8)
+	    break;
+	}
+      auto res = utf16_bytes_to_utf32_block (from, from_end, to, to_end,
+					     little_endian, 8);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+SIMD_TARGET ("sse2")
+result
+utf32_to_utf16_bytes_sse2 (const char32_t *&from, const char32_t *from_end,
+			   unsigned char *&to, unsigned char *to_end,
+			   bool little_endian)
+{
+  while (from != from_end)
+    {
+      while (from_end - from >= 8 && to_end - to >= 16)
+	{
+	  auto a = _mm_loadu_si128 ((const __m128i *) from);
+	  auto b = _mm_loadu_si128 ((const __m128i *) from + 1);
+	  // BMP is 0 in the high half, packs works on signed values
+	  auto ab_hi = _mm_packs_epi32 (_mm_srli_epi32 (a, 16),
+					_mm_srli_epi32 (b, 16));
+	  auto bias = _mm_set1_epi32 (0x8000);
+	  auto x = _mm_packs_epi32 (_mm_sub_epi32 (a, bias),
+				    _mm_sub_epi32 (b, bias));
+	  x = _mm_add_epi16 (x, _mm_set1_epi16 (-0x8000));
+	  auto bad = _mm_or_si128 (utf16_surrogates_sse2 (x),
+				   _mm_cmpeq_epi16 (
+				     _mm_cmpeq_epi16 (ab_hi,
+						      _mm_setzero_si128 ()),
+				     _mm_setzero_si128 ()));
+	  auto n = first_unit (_mm_movemask_epi8 (bad));
+	  _mm_storeu_si128 ((__m128i *) to, utf16_swap_sse2 (x, little_endian));
+	  from += n;
+	  to += 2 * n;
+	  if (n != 8)
+	    break;
+	}
+      auto res = utf32_to_utf16_bytes_block (from, from_end, to, to_end,
+					     little_endian, 8);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+SIMD_TARGET ("sse2")
+result
+utf16_bytes_to_ucs2_sse2 (const unsigned char *&from,
+			  const unsigned char *from_end, char16_t *&to,
+			  char16_t *to_end, bool little_endian)
+{
+  while (from != from_end)
+    {
+      while (from_end - from >= 16 && to_end - to >= 8)
+	{
+	  auto x = utf16_swap_sse2 (_mm_loadu_si128 ((const __m128i *) from),
+				    little_endian);
+	  auto n = first_unit (
+	    _mm_movemask_epi8 (utf16_surrogates_sse2 (x)));
+	  _mm_storeu_si128 ((__m128i *) to, x);
+	  from += 2 * n;
+	  to += n;
+	  if (n != 8)
+	    break;
+	}
+      if (from == from_end)
+	break;
+      if (to == to_end)
+	return codecvt_base::partial;
+      auto res = utf16_bytes_to_ucs2_one (from, from_end, to, little_endian);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+SIMD_TARGET ("sse2")
+result
+ucs2_to_utf16_bytes_sse2 (const char16_t *&from, const char16_t *from_end,
+			  unsigned char *&to, unsigned char *to_end,
+			  bool little_endian)
+{
+  while (from != from_end)
+    {
+      while (from_end - from >= 8 && to_end - to >= 16)
+	{
+	  auto x = _mm_loadu_si128 ((const __m128i *) from);
+	  auto n = first_unit (
+	    _mm_movemask_epi8 (utf16_surrogates_sse2 (x)));
+	  _mm_storeu_si128 ((__m128i *) to, utf16_swap_sse2 (x, little_endian));
+	  from += n;
+	  to += 2 * n;
+	  if (n != 8)
+	    break;
+	}
+      if (from == from_end)
+	break;
+      auto res = ucs2_to_utf16_bytes_one (*from, to, to_end, little_endian);
+      if (res != codecvt_base::ok)
+	return res;
+      ++from;
+    }
+  return codecvt_base::ok;
+}
+
+// The AVX2 versions swap the bytes with one shuffle, which is the identity
+// for little endian data.
+SIMD_TARGET ("avx2")
+inline __m256i
+utf16_swap_mask_avx2 (bool little_endian)
+{
+  if (little_endian)
+    return _mm256_setr_epi8 (0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+			     15, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13,
+			     14, 15);
+  return _mm256_setr_epi8 (1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15,
+			   14, 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12,
+			   15, 14);
+}
+
+SIMD_TARGET ("avx2")
+inline __m256i
+utf16_surrogates_avx2 (__m256i units)
+{
+  return _mm256_cmpeq_epi16 (
+    _mm256_and_si256 (units, _mm256_set1_epi16 (-0x800)),
+    _mm256_set1_epi16 (-0x2800));
+}
+
+// Index of the first 16-bit lane set in a 256-bit compare mask, 16 if none.
+inline int
+first_unit_avx2 (unsigned mask)
+{
+  return mask ? __builtin_ctz (mask) / 2 : 16;
+}
+
+SIMD_TARGET ("avx2")
+result
+utf16_bytes_to_utf32_avx2 (const unsigned char *&from,
+			   const unsigned char *from_end, char32_t *&to,
+			   char32_t *to_end, bool little_endian)
+{
+  auto swap = utf16_swap_mask_avx2 (little_endian);
+  while (from != from_end)
+    {
+      while (from_end - from >= 32 && to_end - to >= 16)
+	{
+	  auto x = _mm256_loadu_si256 ((const __m256i *) from);
+	  x = _mm256_shuffle_epi8 (x, swap);
+	  auto n = first_unit_avx2 (
+	    _mm256_movemask_epi8 (utf16_surrogates_avx2 (x)));
+	  auto out = (__m256i *) to;
+	  _mm256_storeu_si256 (out,
+			       _mm256_cvtepu16_epi32 (_mm256_castsi256_si128 (x)));
+	  _mm256_storeu_si256 (out + 1, _mm256_cvtepu16_epi32 (
+					  _mm256_extracti128_si256 (x, 1)));
+	  from += 2 * n;
+	  to += n;
+	  if (n != 16)
+	    break;
+	}
+      auto res = utf16_bytes_to_utf32_block (from, from_end, to, to_end,
+					     little_endian, 16);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+SIMD_TARGET ("avx2")
+result
+utf32_to_utf16_bytes_avx2 (const char32_t *&from, const char32_t *from_end,
+			   unsigned char *&to, unsigned char *to_end,
+			   bool little_endian)
+{
+  auto swap = utf16_swap_mask_avx2 (little_endian);
+  while (from != from_end)
+    {
+      while (from_end - from >= 16 && to_end - to >= 32)
+	{
+	  auto a = _mm256_loadu_si256 ((const __m256i *) from);
+	  auto b = _mm256_loadu_si256 ((const __m256i *) from + 1);
+	  auto hi = _mm256_packus_epi32 (_mm256_srli_epi32 (a, 16),
+					 _mm256_srli_epi32 (b, 16));
+	  auto x = _mm256_packus_epi32 (
+	    _mm256_and_si256 (a, _mm256_set1_epi32 (0xFFFF)),
+	    _mm256_and_si256 (b, _mm256_set1_epi32 (0xFFFF)));
+	  // packus works within 128-bit lanes
+	  hi = _mm256_permute4x64_epi64 (hi, 0xD8);
+	  x = _mm256_permute4x64_epi64 (x, 0xD8);
+	  auto not_bmp = _mm256_xor_si256 (
+	    _mm256_cmpeq_epi16 (hi, _mm256_setzero_si256 ()),
+	    _mm256_set1_epi8 (-1));
+	  auto bad = _mm256_or_si256 (utf16_surrogates_avx2 (x), not_bmp);
+	  auto n = first_unit_avx2 (_mm256_movemask_epi8 (bad));
+	  _mm256_storeu_si256 ((__m256i *) to, _mm256_shuffle_epi8 (x, swap));
+	  from += n;
+	  to += 2 * n;
+	  if (n != 16)
+	    break;
+	}
+      auto res = utf32_to_utf16_bytes_block (from, from_end, to, to_end,
+					     little_endian, 16);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+SIMD_TARGET ("avx2")
+result
+utf16_bytes_to_ucs2_avx2 (const unsigned char *&from,
+			  const unsigned char *from_end, char16_t *&to,
+			  char16_t *to_end, bool little_endian)
+{
+  auto swap = utf16_swap_mask_avx2 (little_endian);
+  while (from != from_end)
+    {
+      while (from_end - from >= 32 && to_end - to >= 16)
+	{
+	  auto x = _mm256_loadu_si256 ((const __m256i *) from);
+	  x = _mm256_shuffle_epi8 (x, swap);
+	  auto n = first_unit_avx2 (
+	    _mm256_movemask_epi8 (utf16_surrogates_avx2 (x)));
+	  _mm256_storeu_si256 ((__m256i *) to, x);
+	  from += 2 * n;
+	  to += n;
+	  if (n != 16)
+	    break;
+	}
+      if (from == from_end)
+	break;
+      if (to == to_end)
+	return codecvt_base::partial;
+      auto res = utf16_bytes_to_ucs2_one (from, from_end, to, little_endian);
+      if (res != codecvt_base::ok)
+	return res;
+    }
+  return codecvt_base::ok;
+}
+
+SIMD_TARGET ("avx2")
+result
+ucs2_to_utf16_bytes_avx2 (const char16_t *&from, const char16_t *from_end,
+			  unsigned char *&to, unsigned char *to_end,
+			  bool little_endian)
+{
+  auto swap = utf16_swap_mask_avx2 (little_endian);
+  while (from != from_end)
+    {
+      while (from_end - from >= 16 && to_end - to >= 32)
+	{
+	  auto x = _mm256_loadu_si256 ((const __m256i *) from);
+	  auto n = first_unit_avx2 (
+	    _mm256_movemask_epi8 (utf16_surrogates_avx2 (x)));
+	  _mm256_storeu_si256 ((__m256i *) to, _mm256_shuffle_epi8 (x, swap));
+	  from += n;
+	  to += 2 * n;
+	  if (n != 16)
+	    break;
+	}
+      if (from == from_end)
+	break;
+      auto res = ucs2_to_utf16_bytes_one (*from, to, to_end, little_endian);
+      if (res != codecvt_base::ok)
+	return res;
+      ++from;
+    }
+  return codecvt_base::ok;
+}
+
+#endif // UTF_KERNELS_X86
+
+// One set of kernels per instruction set.
+struct utf_kernel_set
+{
+  result (*utf8_to_utf32) (const unsigned char *&, const unsigned char *,
+			   char32_t *&, char32_t *);
+  result (*utf32_to_utf8) (const char32_t *&, const char32_t *,
+			   unsigned char *&, unsigned char *);
+  result (*utf8_to_utf16) (const unsigned char *&, const unsigned char *,
+			   char16_t *&, char16_t *);
+  result (*utf16_to_utf8) (const char16_t *&, const char16_t *,
+			   unsigned char *&, unsigned char *);
+  result (*utf16_bytes_to_utf32) (const unsigned char *&,
+				  const unsigned char *, char32_t *&,
+				  char32_t *, bool);
+  result (*utf32_to_utf16_bytes) (const char32_t *&, const char32_t *,
+				  unsigned char *&, unsigned char *, bool);
+  result (*utf16_bytes_to_ucs2) (const unsigned char *&,
+				 const unsigned char *, char16_t *&,
+				 char16_t *, bool);
+  result (*ucs2_to_utf16_bytes) (const char16_t *&, const char16_t *,
+				 unsigned char *&, unsigned char *, bool);
+};
+
+const utf_kernel_set scalar_kernels
+  = {utf8_to_utf32_scalar, utf32_to_utf8_scalar,
+     utf8_to_utf16_scalar, utf16_to_utf8_scalar,
+     utf16_bytes_to_utf32_scalar, utf32_to_utf16_bytes_scalar,
+     utf16_bytes_to_ucs2_scalar, ucs2_to_utf16_bytes_scalar};
+
+#if UTF_KERNELS_X86
+// The UTF-16 byte order kernels need nothing above SSE2.
+const utf_kernel_set sse42_kernels
+  = {utf8_to_utf32_sse42, utf32_to_utf8_sse42,
+     utf8_to_utf16_sse42, utf16_to_utf8_sse42,
+     utf16_bytes_to_utf32_sse2, utf32_to_utf16_bytes_sse2,
+     utf16_bytes_to_ucs2_sse2, ucs2_to_utf16_bytes_sse2};
+
+const utf_kernel_set avx2_kernels
+  = {utf8_to_utf32_avx2, utf32_to_utf8_avx2,
+     utf8_to_utf16_avx2, utf16_to_utf8_avx2,
+     utf16_bytes_to_utf32_avx2, utf32_to_utf16_bytes_avx2,
+     utf16_bytes_to_ucs2_avx2, ucs2_to_utf16_bytes_avx2};
+
+// Only the UTF-8 kernels are widened, see utf8_to_utf32_avx512.
+const utf_kernel_set avx512_kernels
+  = {utf8_to_utf32_avx512, utf32_to_utf8_avx512,
+     utf8_to_utf16_avx512, utf16_to_utf8_avx512,
+     utf16_bytes_to_utf32_avx2, utf32_to_utf16_bytes_avx2,
+     utf16_bytes_to_ucs2_avx2, ucs2_to_utf16_bytes_avx2};
+#endif
+
+// Indexed by utf_kernel_level, null if the level is not compiled in.
+const utf_kernel_set *const kernel_sets[] = {
+  &scalar_kernels,
+#if UTF_KERNELS_X86
+  &sse42_kernels,
+  &avx2_kernels,
+  &avx512_kernels,
+#else
+  nullptr,
+  nullptr,
+  nullptr,
+#endif
+};
+
+const char *const level_names[] = {"scalar", "sse4.2", "avx2", "avx512"};
+
+// Asks cpuid, __builtin_cpu_supports also checks that the OS saves the
+// vector registers.
+bool
+cpu_supports (utf_kernel_level level)
+{
+  if (!kernel_sets[level])
+    return false;
+#if UTF_KERNELS_X86
+  __builtin_cpu_init ();
+  switch (level)
+    {
+    case utf_kernel_scalar:
+      return true;
+    case utf_kernel_sse42:
+      return __builtin_cpu_supports ("sse4.2")
+	     && __builtin_cpu_supports ("popcnt");
+    case utf_kernel_avx2:
+      return __builtin_cpu_supports ("avx2")
+	     && __builtin_cpu_supports ("popcnt");
+    case utf_kernel_avx512:
+      return __builtin_cpu_supports ("avx512f")
+	     && __builtin_cpu_supports ("avx512bw")
+	     && __builtin_cpu_supports ("popcnt");
+    }
+#endif
+  return level == utf_kernel_scalar;
+}
+
+utf_kernel_level
+best_level ()
+{
+  for (int l = utf_kernel_avx512; l > utf_kernel_scalar; --l)
+    if (cpu_supports (utf_kernel_level (l)))
+      return utf_kernel_level (l);
+  return utf_kernel_scalar;
+}
+
+// The best level, or the one named by the environment variable UTF_KERNELS
+// if the CPU supports it. Any other value is reported on stderr and the best
+// level is used.
+utf_kernel_level
+initial_level ()
+{
+  auto env = getenv ("UTF_KERNELS");
+  if (!env || !*env)
+    return best_level ();
+  for (int l = utf_kernel_scalar; l <= utf_kernel_avx512; ++l)
+    if (strcmp (env, level_names[l]) == 0)
+      {
+	if (cpu_supports (utf_kernel_level (l)))
+	  return utf_kernel_level (l);
+	fprintf (stderr,
+		 "UTF_KERNELS=%s: not supported by this CPU, using %s\n", env,
+		 level_names[best_level ()]);
+	return best_level ();
+      }
+  fprintf (stderr,
+	   "UTF_KERNELS=%s: unknown level, expected scalar, sse4.2, avx2 or "
+	   "avx512, using %s\n",
+	   env, level_names[best_level ()]);
+  return best_level ();
+}
+
+// Selected on first use, so that facets can be used during static
+// initialization of other translation units. The tables above are constexpr,
+// so they are ready before any constructor runs.
+atomic<utf_kernel_level> &
+current_level ()
+{
+  static atomic<utf_kernel_level> level {initial_level ()};
+  return level;
+}
+
+// Set by set_thread_utf_kernel_level, -1 if the thread follows
+// current_level.
+thread_local int thread_level = -1;
+
+utf_kernel_level
+effective_level ()
+{
+  if (thread_level >= 0)
+    return utf_kernel_level (thread_level);
+  return current_level ().load (memory_order_relaxed);
+}
+
+const utf_kernel_set &
+kernels ()
+{
+  return *kernel_sets[effective_level ()];
+}
+
+} // namespace
+
+const char *
+utf_kernel_level_name (utf_kernel_level level)
+{
+  return level_names[level];
+}
+
+utf_kernel_level
+utf_kernel_best_level ()
+{
+  static const auto level = best_level ();
+  return level;
+}
+
+utf_kernel_level
+utf_kernel_current_level ()
+{
+  return effective_level ();
+}
+
+bool
+set_utf_kernel_level (utf_kernel_level level)
+{
+  if (level < utf_kernel_scalar || level > utf_kernel_avx512
+      || !cpu_supports (level))
+    return false;
+  current_level ().store (level, memory_order_relaxed);
+  return true;
+}
+
+bool
+set_thread_utf_kernel_level (utf_kernel_level level)
+{
+  if (level < utf_kernel_scalar || level > utf_kernel_avx512
+      || !cpu_supports (level))
+    return false;
+  thread_level = level;
+  return true;
+}
+
+void
+reset_thread_utf_kernel_level ()
+{
+  thread_level = -1;
+}
+
+result
+utf8_to_utf32 (const unsigned char *&from, const unsigned char *from_end,
+	       char32_t *&to, char32_t *to_end)
+{
+  return kernels ().utf8_to_utf32 (from, from_end, to, to_end);
+}
+
+result
+utf32_to_utf8 (const char32_t *&from, const char32_t *from_end,
+	       unsigned char *&to, unsigned char *to_end)
+{
+  return kernels ().utf32_to_utf8 (from, from_end, to, to_end);
+}
+
+result
+utf8_to_utf16 (const unsigned char *&from, const unsigned char *from_end,
+	       char16_t *&to, char16_t *to_end)
+{
+  return kernels ().utf8_to_utf16 (from, from_end, to, to_end);
+}
+
+result
+utf16_to_utf8 (const char16_t *&from, const char16_t *from_end,
+	       unsigned char *&to, unsigned char *to_end)
+{
+  return kernels ().utf16_to_utf8 (from, from_end, to, to_end);
+}
+
+result
+utf16_bytes_to_utf32 (const unsigned char *&from,
+		      const unsigned char *from_end, char32_t *&to,
+		      char32_t *to_end, bool little_endian)
+{
+  return kernels ().utf16_bytes_to_utf32 (from, from_end, to, to_end,
+					  little_endian);
+}
+
+result
+utf32_to_utf16_bytes (const char32_t *&from, const char32_t *from_end,
+		      unsigned char *&to, unsigned char *to_end,
+		      bool little_endian)
+{
+  return kernels ().utf32_to_utf16_bytes (from, from_end, to, to_end,
+					  little_endian);
+}
+
+result
+utf16_bytes_to_ucs2 (const unsigned char *&from, const unsigned char *from_end,
+		     char16_t *&to, char16_t *to_end, bool little_endian)
+{
+  return kernels ().utf16_bytes_to_ucs2 (from, from_end, to, to_end,
+					 little_endian);
+}
+
+result
+ucs2_to_utf16_bytes (const char16_t *&from, const char16_t *from_end,
+		     unsigned char *&to, unsigned char *to_end,
+		     bool little_endian)
+{
+  return kernels ().ucs2_to_utf16_bytes (from, from_end, to, to_end,
+					 little_endian);
+}
+
+result
+utf8_to_utf32_dfa (const unsigned char *&from, const unsigned char *from_end,
+		   char32_t *&to, char32_t *to_end)
+{
+  return utf8_dfa_decode (from, from_end, to, to_end);
+}
+
+result
+utf8_to_utf16_dfa (const unsigned char *&from, const unsigned char *from_end,
+		   char16_t *&to, char16_t *to_end)
+{
+  return utf8_dfa_decode (from, from_end, to, to_end);
+}
@@ -0,0 +1,183 @@
+// Copyright 2020-2023 Dimitrij Mijoski
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef UTF_KERNELS_H
+#define UTF_KERNELS_H
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <locale>
+
+// Conversion kernels used by the accelerated facets. They follow the
+// semantics of the codecvt member functions that the test suite checks:
+// on return, from and to point one past the last fully converted character.
+// The result is ok if the whole input was converted, partial if there is no
+// space for the next character or the input ends with an incomplete
+// character, and error if the next character is malformed.
+//
+// The kernels may use [to_next, to_end) as scratch space. They are
+// dispatched at run time to the highest instruction set level that the CPU
+// supports, see utf_kernel_level below.
+
+// Instruction set levels of the kernels. Only utf_kernel_scalar is available
+// on other CPUs than x86.
+enum utf_kernel_level
+{
+  utf_kernel_scalar,
+  utf_kernel_sse42,
+  utf_kernel_avx2,
+  utf_kernel_avx512
+};
+
+// "scalar", "sse4.2", "avx2" or "avx512".
+const char *
+utf_kernel_level_name (utf_kernel_level level);
+
+// The highest level that the CPU supports.
+utf_kernel_level
+utf_kernel_best_level ();
+
+// The level that the kernels use on the calling thread. It starts as the
+// best level, unless the environment variable UTF_KERNELS holds the name of
+// another level that the CPU supports. Other values are reported on stderr.
+utf_kernel_level
+utf_kernel_current_level ();
+
+// Switches all kernels to level. Returns false and changes nothing if the
+// CPU does not support it. Every kernel call uses one level from start to
+// end, even if the level is switched on another thread in the meantime.
+bool
+set_utf_kernel_level (utf_kernel_level level);
+
+// Like set_utf_kernel_level, but only for the calling thread, which stops
+// following set_utf_kernel_level until reset_thread_utf_kernel_level is
+// called. Lets tests run the levels concurrently on different threads.
+bool
+set_thread_utf_kernel_level (utf_kernel_level level);
+
+void
+reset_thread_utf_kernel_level ();
+
+std::codecvt_base::result
+utf8_to_utf32 (const unsigned char *&from, const unsigned char *from_end,
+	       char32_t *&to, char32_t *to_end);
+
+std::codecvt_base::result
+utf32_to_utf8 (const char32_t *&from, const char32_t *from_end,
+	       unsigned char *&to, unsigned char *to_end);
+
+// Internal characters outside of the BMP are surrogate pairs.
+std::codecvt_base::result
+utf8_to_utf16 (const unsigned char *&from, const unsigned char *from_end,
+	       char16_t *&to, char16_t *to_end);
+
+std::codecvt_base::result
+utf16_to_utf8 (const char16_t *&from, const char16_t *from_end,
+	       unsigned char *&to, unsigned char *to_end);
+
+// UTF-16 as a sequence of bytes in big or little endian byte order, like
+// codecvt_utf16 converts it.
+std::codecvt_base::result
+utf16_bytes_to_utf32 (const unsigned char *&from,
+		      const unsigned char *from_end, char32_t *&to,
+		      char32_t *to_end, bool little_endian);
+
+std::codecvt_base::result
+utf32_to_utf16_bytes (const char32_t *&from, const char32_t *from_end,
+		      unsigned char *&to, unsigned char *to_end,
+		      bool little_endian);
+
+// Internal characters are UCS-2, any surrogate code unit is an error.
+std::codecvt_base::result
+utf16_bytes_to_ucs2 (const unsigned char *&from, const unsigned char *from_end,
+		     char16_t *&to, char16_t *to_end, bool little_endian);
+
+std::codecvt_base::result
+ucs2_to_utf16_bytes (const char16_t *&from, const char16_t *from_end,
+		     unsigned char *&to, unsigned char *to_end,
+		     bool little_endian);
+
+// Portable table-driven decoders, not dispatched on the CPU. Same results as
+// utf8_to_utf32 and utf8_to_utf16.
+std::codecvt_base::result
+utf8_to_utf32_dfa (const unsigned char *&from, const unsigned char *from_end,
+		   char32_t *&to, char32_t *to_end);
+
+std::codecvt_base::result
+utf8_to_utf16_dfa (const unsigned char *&from, const unsigned char *from_end,
+		   char16_t *&to, char16_t *to_end);
+
+// The kernels of in () and out () by internal character type, for the
+// facet templates.
+template <class InternT> struct utf8_kernels;
+
+template <> struct utf8_kernels<char32_t>
+{
+  static constexpr auto in = utf8_to_utf32;
+  static constexpr auto out = utf32_to_utf8;
+};
+
+template <> struct utf8_kernels<char16_t>
+{
+  static constexpr auto in = utf8_to_utf16;
+  static constexpr auto out = utf16_to_utf8;
+};
+
+// Also take the byte order.
+template <class InternT> struct utf16_kernels;
+
+template <> struct utf16_kernels<char32_t>
+{
+  static constexpr auto in = utf16_bytes_to_utf32;
+  static constexpr auto out = utf32_to_utf16_bytes;
+};
+
+template <> struct utf16_kernels<char16_t>
+{
+  static constexpr auto in = utf16_bytes_to_ucs2;
+  static constexpr auto out = ucs2_to_utf16_bytes;
+};
+
+template <class InternT> struct utf8_dfa_kernels;
+
+template <> struct utf8_dfa_kernels<char32_t>
+{
+  static constexpr auto in = utf8_to_utf32_dfa;
+  static constexpr auto out = utf32_to_utf8;
+};
+
+template <> struct utf8_dfa_kernels<char16_t>
+{
+  static constexpr auto in = utf8_to_utf16_dfa;
+  static constexpr auto out = utf16_to_utf8;
+};
+
+// Runs the in() kernel over a scratch buffer to count how many external
+// characters convert to at most max internal characters, for do_length ()
+// of the facets. Kernel is called as kernel (from, from_end, to, to_end).
+//
+// The kernel also stops with partial before the end of the buffer when a
+// surrogate pair does not fit in the last unit, then the count continues in
+// the next buffer. If that makes no progress, the pair does not fit in max
+// or the input ends with an incomplete character.
+template <class InternT, class Kernel>
+int
+length_by_kernel (Kernel kernel, const unsigned char *from,
+		  const unsigned char *from_end, size_t max)
+{
+  auto start = from;
+  InternT buf[256];
+  while (max != 0)
+    {
+      auto to = buf;
+      auto to_end = buf + std::min (max, std::size (buf));
+      auto res = kernel (from, from_end, to, to_end);
+      max -= to - buf;
+      if (res != std::codecvt_base::partial || to == buf || to_end - to >= 2)
+	break;
+    }
+  return from - start;
+}
+
+#endif // UTF_KERNELS_H